@@ -3,6 +3,7 @@
 #include "defines.h"
 #include "structs.h"
 #include "attachments.h"
+#include "trace.h"
 #include <json-glib/json-glib.h>
 
 #if !(GLIB_CHECK_VERSION(2, 67, 3))
@@ -90,7 +91,9 @@ signald_parse_attachment(SignaldAccount *sa, JsonObject *obj, GString *message)
     }
 
     if (is_loadable_image_mimetype(type)) {
+        gint64 start = signald_trace_begin();
         PurpleStoredImage *img = purple_imgstore_new_from_file(fn); // TODO: forward "access denied" error to UI
+        signald_trace_end("purple_imgstore_new_from_file", type, start);
         size_t size = purple_imgstore_get_size(img);
         int img_id = purple_imgstore_add_with_id(g_memdup2(purple_imgstore_get_data(img), size), size, NULL);
 
@@ -112,7 +115,10 @@ signald_prepare_attachments_message(SignaldAccount *sa, JsonObject *obj) {
         JsonArray *attachments = json_object_get_array_member(obj, "attachments");
         guint len = json_array_get_length(attachments);
         for (guint i=0; i < len; i++) {
-            signald_parse_attachment(sa, json_array_get_object_element(attachments, i), attachments_message);
+            JsonObject *attachment = json_array_get_object_element(attachments, i);
+            gint64 start = signald_trace_begin();
+            signald_parse_attachment(sa, attachment, attachments_message);
+            signald_trace_end("attachment", json_object_get_string_member(attachment, "contentType"), start);
         }
     }
 
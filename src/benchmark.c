@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "purple_compat.h"
+#include "defines.h"
+#include "json-writer.h"
+#include "input.h"
+#include "harness.h"
+
+/*
+ * Micro-benchmark of the incoming message path (the signald-benchmark executable).
+ *
+ * A corpus of synthetic payloads is wrapped into IncomingMessage frames, which are parsed and handed to
+ * signald_handle_input repeatedly (signald_process_message, signald_format_message and displaying included).
+ * The plugin runs in a headless libpurple core with a sandbox account, see harness.c.
+ * Reported are the average times and allocations for parsing and handling per message.
+ *
+ * Mentions and quotes refer to buddies of the account, so the alias lookups are realistic.
+ *
+ * Additionally, the same payloads and a typical send request are serialized by json-writer.c
+ * and by JsonGenerator (the way requests were serialized before), reporting time and bytes per frame.
+ */
+
+#define SIGNALD_BENCHMARK_ITERATIONS 1000
+#define SIGNALD_BENCHMARK_MENTIONS 50
+#define SIGNALD_BENCHMARK_QUOTE_LINES 100
+#define SIGNALD_BENCHMARK_ATTACHMENTS 4
+#define SIGNALD_BENCHMARK_ACCOUNT "00000000-0000-4000-8000-000000000000"
+
+#if defined(__GLIBC__)
+/*
+ * glibc's allocator is wrapped to count allocations. Since the executable defines these functions,
+ * they take precedence for all libraries (glib and json-glib included).
+ * GLib before 2.76 takes small blocks (e.g. JsonNode and JsonObject) from GSlice, so main makes GSlice use malloc.
+ */
+#define SIGNALD_BENCHMARK_COUNT_ALLOCATIONS
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 signald_benchmark_allocations = 0;
+
+void *
+malloc(size_t size)
+{
+    __atomic_add_fetch(&signald_benchmark_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&signald_benchmark_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&signald_benchmark_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+/*
+ * Returns the number of allocations so far, 0 if they are not counted.
+ */
+static guint64
+signald_benchmark_allocation_count(void)
+{
+#ifdef SIGNALD_BENCHMARK_COUNT_ALLOCATIONS
+    return __atomic_load_n(&signald_benchmark_allocations, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Returns the identifier of a buddy for mentions and quotes, so the aliases can be looked up.
+ * Falls back to a made-up identifier in case there are not enough buddies.
+ */
+static gchar *
+signald_benchmark_uuid(GSList *buddies, int i)
+{
+    if (buddies != NULL) {
+        return g_strdup(purple_buddy_get_name(g_slist_nth_data(buddies, i % g_slist_length(buddies))));
+    }
+    return g_strdup_printf("00000000-0000-4000-8000-%012d", i + 1);
+}
+
+typedef struct {
+    const char *name;
+    gchar *json; // the message's data object
+} SignaldBenchmarkPayload;
+
+static gchar *
+signald_benchmark_serialize(JsonObject *data)
+{
+    GString *json = g_string_new(NULL);
+    signald_json_write_object(json, data);
+    json_object_unref(data);
+    return g_string_free(json, FALSE);
+}
+
+static JsonObject *
+signald_benchmark_data(const char *body)
+{
+    JsonObject *data = json_object_new();
+    json_object_set_int_member(data, "timestamp", 1700000000000);
+    json_object_set_string_member(data, "body", body);
+    return data;
+}
+
+static gchar *
+signald_benchmark_plain(void)
+{
+    return signald_benchmark_serialize(signald_benchmark_data("Hello! This is a plain text message of typical length. How are you doing today?"));
+}
+
+static gchar *
+signald_benchmark_mentions(GSList *buddies)
+{
+    const char mention_glyph[] = {0xEF, 0xBF, 0xBC, 0x00};
+    GString *body = g_string_new("Attention ");
+    JsonArray *mentions = json_array_new();
+    for (int i = 0; i < SIGNALD_BENCHMARK_MENTIONS; i++) {
+        JsonObject *mention = json_object_new();
+        json_object_set_int_member(mention, "start", body->len);
+        json_object_set_int_member(mention, "length", 1);
+        gchar *uuid = signald_benchmark_uuid(buddies, i);
+        json_object_set_string_member(mention, "uuid", uuid);
+        g_free(uuid);
+        json_array_add_object_element(mentions, mention);
+        g_string_append(body, mention_glyph);
+        g_string_append(body, ", ");
+    }
+    g_string_append(body, "please have a look.");
+    JsonObject *group = json_object_new();
+    json_object_set_string_member(group, "id", "YmVuY2htYXJrLWdyb3VwLWlkZW50aWZpZXI=");
+    JsonObject *data = signald_benchmark_data(body->str);
+    json_object_set_array_member(data, "mentions", mentions);
+    json_object_set_object_member(data, "groupV2", group);
+    g_string_free(body, TRUE);
+    return signald_benchmark_serialize(data);
+}
+
+static gchar *
+signald_benchmark_quote(GSList *buddies)
+{
+    GString *text = g_string_new(NULL);
+    for (int i = 0; i < SIGNALD_BENCHMARK_QUOTE_LINES; i++) {
+        g_string_append_printf(text, "%sThis is line %d of a long quoted message.", i ? "\n" : "", i);
+    }
+    JsonObject *author = json_object_new();
+    gchar *uuid = signald_benchmark_uuid(buddies, 0);
+    json_object_set_string_member(author, "uuid", uuid);
+    g_free(uuid);
+    JsonObject *quote = json_object_new();
+    json_object_set_int_member(quote, "id", 1699999999000);
+    json_object_set_object_member(quote, "author", author);
+    json_object_set_string_member(quote, "text", text->str);
+    g_string_free(text, TRUE);
+    JsonObject *data = signald_benchmark_data("I agree.");
+    json_object_set_object_member(data, "quote", quote);
+    return signald_benchmark_serialize(data);
+}
+
+static gchar *
+signald_benchmark_attachments(void)
+{
+    JsonArray *attachments = json_array_new();
+    for (int i = 0; i < SIGNALD_BENCHMARK_ATTACHMENTS; i++) {
+        JsonObject *attachment = json_object_new();
+        // not an image, so nothing is loaded from disk
+        json_object_set_string_member(attachment, "contentType", "application/pdf");
+        gchar *filename = g_strdup_printf("/nonexistent/signald/attachments/%d", i);
+        json_object_set_string_member(attachment, "storedFilename", filename);
+        g_free(filename);
+        json_object_set_int_member(attachment, "size", 123456);
+        json_array_add_object_element(attachments, attachment);
+    }
+    JsonObject *data = signald_benchmark_data("Some documents.");
+    json_object_set_array_member(data, "attachments", attachments);
+    return signald_benchmark_serialize(data);
+}
+
+static gchar *
+signald_benchmark_send_request(void)
+{
+    JsonObject *address = json_object_new();
+    json_object_set_string_member(address, "uuid", "00000000-0000-4000-8000-000000000001");
+    JsonObject *data = json_object_new();
+    json_object_set_string_member(data, "type", "send");
+    json_object_set_string_member(data, "account", "00000000-0000-4000-8000-000000000000");
+    json_object_set_object_member(data, "recipientAddress", address);
+    json_object_set_array_member(data, "attachments", json_array_new());
+    json_object_set_string_member(data, "messageBody", "Hello! This is a \"plain\" text message of typical length.\nHow are you doing today?");
+    json_object_set_string_member(data, "version", "v1");
+    json_object_set_string_member(data, "id", "12345");
+    return signald_benchmark_serialize(data);
+}
+
+/*
+ * Adds buddies with aliases to the account, so mentions and quotes can be resolved.
+ */
+static void
+signald_benchmark_add_buddies(SignaldAccount *sa)
+{
+    for (int i = 0; i < SIGNALD_BENCHMARK_MENTIONS; i++) {
+        gchar *uuid = signald_benchmark_uuid(NULL, i);
+        gchar *alias = g_strdup_printf("Buddy %d", i);
+        purple_blist_add_buddy(purple_buddy_new(sa->account, uuid, alias), NULL, NULL, NULL);
+        g_free(alias);
+        g_free(uuid);
+    }
+}
+
+/*
+ * Wraps the message's data object into an IncomingMessage frame as sent by signald.
+ */
+static gchar *
+signald_benchmark_frame(const char *data_message)
+{
+    gchar *author = signald_benchmark_uuid(NULL, 0);
+    gchar *frame = g_strdup_printf(
+        "{\"type\":\"IncomingMessage\",\"version\":\"v1\",\"account\":\"%s\",\"data\":{\"account\":\"%s\","
+        "\"source\":{\"uuid\":\"%s\"},\"timestamp\":1700000000000,\"server_receiver_timestamp\":1700000000100,"
+        "\"server_deliver_timestamp\":1700000000200,\"data_message\":%s}}",
+        SIGNALD_BENCHMARK_ACCOUNT, SIGNALD_BENCHMARK_ACCOUNT, author, data_message);
+    g_free(author);
+    return frame;
+}
+
+/*
+ * Returns the root object of the parsed payload. A payload which cannot be parsed is a bug of the benchmark, it aborts.
+ */
+static JsonObject *
+signald_benchmark_parsed(JsonParser *parser, gboolean parsed, SignaldBenchmarkPayload *payload)
+{
+    JsonNode *root = parsed ? json_parser_get_root(parser) : NULL;
+    if (root == NULL || !JSON_NODE_HOLDS_OBJECT(root)) {
+        fprintf(stderr, "Payload %s cannot be parsed.\n", payload->name);
+        abort();
+    }
+    return json_node_get_object(root);
+}
+
+static void
+signald_benchmark_run(SignaldAccount *sa, SignaldBenchmarkPayload *payload)
+{
+    gchar *frame = signald_benchmark_frame(payload->json);
+    gsize length = strlen(frame);
+    JsonParser *parser = json_parser_new();
+    gint64 parse_time = 0;
+    gint64 handle_time = 0;
+    guint64 parse_allocations = 0;
+    guint64 handle_allocations = 0;
+    for (int i = 0; i < SIGNALD_BENCHMARK_ITERATIONS; i++) {
+        guint64 allocations = signald_benchmark_allocation_count();
+        gint64 start = g_get_monotonic_time();
+        gboolean loaded = json_parser_load_from_data(parser, frame, length, NULL);
+        gint64 parsed = g_get_monotonic_time();
+        parse_allocations += signald_benchmark_allocation_count() - allocations;
+        // every message is a new one (receipts, caches and logs would treat repetitions differently)
+        JsonObject *data = json_object_get_object_member(signald_benchmark_parsed(parser, loaded, payload), "data");
+        JsonNode *root = json_parser_get_root(parser);
+        json_object_set_int_member(data, "timestamp", 1700000000000 + i);
+        allocations = signald_benchmark_allocation_count();
+        gint64 before = g_get_monotonic_time();
+        signald_handle_input(sa, root);
+        gint64 handled = g_get_monotonic_time();
+        handle_allocations += signald_benchmark_allocation_count() - allocations;
+        parse_time += parsed - start;
+        handle_time += handled - before;
+    }
+    g_object_unref(parser);
+    g_free(frame);
+
+    printf("%s (%" G_GSIZE_FORMAT " bytes): parse %" G_GINT64_FORMAT " ns, handle %" G_GINT64_FORMAT " ns",
+        payload->name, length, parse_time * 1000 / SIGNALD_BENCHMARK_ITERATIONS, handle_time * 1000 / SIGNALD_BENCHMARK_ITERATIONS);
+#ifdef SIGNALD_BENCHMARK_COUNT_ALLOCATIONS
+    printf(", allocations: parse %.1f, handle %.1f",
+        (double)parse_allocations / SIGNALD_BENCHMARK_ITERATIONS, (double)handle_allocations / SIGNALD_BENCHMARK_ITERATIONS);
+#endif
+    printf(" per message\n");
+}
+
+/*
+ * Serializes the payload with json-writer.c and with JsonGenerator.
+ */
+static void
+signald_benchmark_serializers(SignaldBenchmarkPayload *payload)
+{
+    JsonParser *parser = json_parser_new();
+    JsonObject *data = signald_benchmark_parsed(parser, json_parser_load_from_data(parser, payload->json, -1, NULL), payload);
+
+    // json-writer.c, re-using the buffer like the output pool does
+    GString *out = g_string_new(NULL);
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < SIGNALD_BENCHMARK_ITERATIONS; i++) {
+        g_string_truncate(out, 0);
+        signald_json_write_object(out, data);
+    }
+    gint64 writer_time = g_get_monotonic_time() - start;
+    gsize writer_length = out->len;
+    g_string_free(out, TRUE);
+
+    // JsonGenerator with a fresh node and generator per frame
+    gsize generator_length = 0;
+    start = g_get_monotonic_time();
+    for (int i = 0; i < SIGNALD_BENCHMARK_ITERATIONS; i++) {
+        JsonNode *node = json_node_new(JSON_NODE_OBJECT);
+        json_node_set_object(node, data);
+        JsonGenerator *generator = json_generator_new();
+        json_generator_set_root(generator, node);
+        gchar *json = json_generator_to_data(generator, &generator_length);
+        g_object_unref(generator);
+        json_node_free(node);
+        g_free(json);
+    }
+    gint64 generator_time = g_get_monotonic_time() - start;
+    g_object_unref(parser);
+
+    printf("%s: json-writer %" G_GINT64_FORMAT " ns (%" G_GSIZE_FORMAT " bytes), JsonGenerator %" G_GINT64_FORMAT " ns (%" G_GSIZE_FORMAT " bytes) per frame\n",
+        payload->name, writer_time * 1000 / SIGNALD_BENCHMARK_ITERATIONS, writer_length, generator_time * 1000 / SIGNALD_BENCHMARK_ITERATIONS, generator_length);
+}
+
+int
+main(int argc, char **argv)
+{
+    // before any use of GLib, see the allocation counting above
+    g_setenv("G_SLICE", "always-malloc", TRUE);
+    if (!signald_harness_init()) {
+        return 1;
+    }
+    SignaldAccount *sa = signald_harness_account_new(SIGNALD_BENCHMARK_ACCOUNT, NULL);
+    if (sa == NULL) {
+        fprintf(stderr, "Cannot log in the sandbox account.\n");
+        signald_harness_shutdown();
+        return 1;
+    }
+    signald_benchmark_add_buddies(sa);
+    GSList *buddies = purple_find_buddies(sa->account, NULL);
+    SignaldBenchmarkPayload payloads[] = {
+        {"plain text", signald_benchmark_plain()},
+        {"mentions", signald_benchmark_mentions(buddies)},
+        {"quote", signald_benchmark_quote(buddies)},
+        {"attachments", signald_benchmark_attachments()},
+    };
+    g_slist_free(buddies);
+
+    printf("Average over %d iterations:\n", SIGNALD_BENCHMARK_ITERATIONS);
+    for (gsize i = 0; i < G_N_ELEMENTS(payloads); i++) {
+        signald_benchmark_run(sa, &payloads[i]);
+    }
+    printf("\nSerialization:\n");
+    SignaldBenchmarkPayload request = {"send request", signald_benchmark_send_request()};
+    signald_benchmark_serializers(&request);
+    g_free(request.json);
+    for (gsize i = 0; i < G_N_ELEMENTS(payloads); i++) {
+        signald_benchmark_serializers(&payloads[i]);
+        g_free(payloads[i].json);
+    }
+
+    signald_harness_account_free(sa);
+    signald_harness_shutdown();
+    return 0;
+}
@@ -4,41 +4,317 @@
 #include "structs.h"
 #include "defines.h"
 #include "comms.h"
-#include "input.h"
+#include "stream.h"
+#include "worker.h"
+#include "connection.h"
+#include "json-writer.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flight-recorder.h"
 #include <json-glib/json-glib.h>
 
+void
+signald_input_buffer_init(SignaldConnection *conn)
+{
+    conn->input_buffer_size = SIGNALD_INPUT_BUFSIZE_INITIAL;
+    conn->input_buffer = g_malloc(conn->input_buffer_size);
+    conn->input_buffer_length = 0;
+    conn->input_frame_peak = 0;
+}
+
+void
+signald_input_buffer_destroy(SignaldConnection *conn)
+{
+    g_free(conn->input_buffer);
+    conn->input_buffer = NULL;
+    conn->input_buffer_size = 0;
+    conn->input_buffer_length = 0;
+}
+
+/*
+ * Doubles the capacity of the input buffer, but not beyond the configured limit.
+ * Returns FALSE in case the buffer already has reached the limit.
+ */
+static gboolean
+signald_input_buffer_grow(SignaldConnection *conn)
+{
+    gsize limit = conn->input_buffer_limit;
+    if (conn->input_buffer_size >= limit) {
+        return FALSE;
+    }
+    conn->input_buffer_size = MIN(conn->input_buffer_size * 2, limit);
+    conn->input_buffer = g_realloc(conn->input_buffer, conn->input_buffer_size);
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Input buffer grown to %" G_GSIZE_FORMAT " bytes.\n", conn->input_buffer_size);
+    return TRUE;
+}
+
+/*
+ * Appends bytes of an incomplete frame to the input buffer, growing it as needed.
+ * Returns FALSE in case the bytes do not fit into the buffer.
+ */
+gboolean
+signald_input_buffer_append(SignaldConnection *conn, const char *data, gsize length)
+{
+    // one byte is always kept for the null-termination
+    while (conn->input_buffer_length + length + 1 > conn->input_buffer_size) {
+        if (!signald_input_buffer_grow(conn)) {
+            return FALSE;
+        }
+    }
+    memcpy(conn->input_buffer + conn->input_buffer_length, data, length);
+    conn->input_buffer_length += length;
+    return TRUE;
+}
+
+/*
+ * Returns the memory of a grown input buffer once the large frame has been handled.
+ */
+static void
+signald_input_buffer_shrink(SignaldConnection *conn)
+{
+    if (conn->input_buffer_size > SIGNALD_INPUT_BUFSIZE_INITIAL && conn->input_buffer_length < SIGNALD_INPUT_BUFSIZE_INITIAL) {
+        conn->input_buffer_size = SIGNALD_INPUT_BUFSIZE_INITIAL;
+        conn->input_buffer = g_realloc(conn->input_buffer, conn->input_buffer_size);
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Input buffer shrunk to %" G_GSIZE_FORMAT " bytes (largest frame so far had %" G_GSIZE_FORMAT " bytes).\n", conn->input_buffer_size, conn->input_frame_peak);
+    }
+}
+
+/*
+ * Hands one frame to the parser.
+ * The frame's newline is located at frame[length]. The byte after it must be accessible.
+ */
+void
+signald_handle_frame(SignaldConnection *conn, char *frame, gsize length)
+{
+    // full frames are logged in verbose mode only, the flight recorder keeps the recent ones
+    if (purple_debug_is_verbose()) {
+        purple_debug_info(SIGNALD_PLUGIN_ID, "got newline delimited message: %.*s\n", (int)length, frame);
+    }
+    signald_flight_recorder_add_raw(conn, frame, length, length);
+    signald_connection_parse(conn, frame, length);
+}
+
+/*
+ * Grants a new work budget for handling incoming frames.
+ * An unlimited budget is used for synchronous (blocking) reads.
+ */
+void
+signald_input_budget_reset(SignaldConnection *conn, gboolean limited)
+{
+    conn->input_budget_frames = -1;
+    conn->input_budget_deadline = G_MAXINT64;
+    if (limited) {
+        if (conn->input_budget_frames_limit > 0) {
+            conn->input_budget_frames = conn->input_budget_frames_limit;
+        }
+        if (conn->input_budget_milliseconds_limit > 0) {
+            conn->input_budget_deadline = g_get_monotonic_time() + (gint64)conn->input_budget_milliseconds_limit * 1000;
+        }
+    }
+}
+
+/*
+ * Accounts for one unit of work (a frame or an element of a streamed array).
+ */
+void
+signald_input_budget_spend(SignaldConnection *conn)
+{
+    if (conn->input_budget_frames > 0) {
+        conn->input_budget_frames--;
+    }
+}
+
+gboolean
+signald_input_budget_exhausted(SignaldConnection *conn)
+{
+    return conn->input_budget_frames == 0 || g_get_monotonic_time() >= conn->input_budget_deadline;
+}
+
+/*
+ * Hands complete newline-delimited frames within the buffer to the parser until the work budget is exhausted.
+ * Returns the number of bytes which have been consumed. Bytes after that belong to frames which have not been handled, yet.
+ * Only the bytes from scan_offset onwards need to be searched for a newline (the ones before have been searched in an earlier call).
+ */
+static gsize
+signald_handle_frames(SignaldConnection *conn, char *buffer, gsize length, gsize scan_offset)
+{
+    char *frame = buffer;
+    char *end = buffer + length;
+    char *newline = memchr(buffer + scan_offset, '\n', end - (buffer + scan_offset));
+    while (newline != NULL && !signald_input_budget_exhausted(conn)) {
+        conn->input_frame_peak = MAX(conn->input_frame_peak, (gsize)(newline + 1 - frame));
+        signald_handle_frame(conn, frame, newline - frame);
+        signald_input_budget_spend(conn);
+        frame = newline + 1;
+        newline = memchr(frame, '\n', end - frame);
+    }
+    return frame - buffer;
+}
+
+/*
+ * Handles the frames held in the input buffer as far as the work budget allows.
+ * The bytes which have not been consumed are moved to the beginning of the buffer.
+ * Returns FALSE in case the budget has been exhausted (the buffer may still contain complete frames).
+ */
+static gboolean
+signald_input_process(SignaldConnection *conn, gsize scan_offset)
+{
+    gsize length = conn->input_buffer_length;
+    gsize consumed = 0;
+    if (conn->input_stream) {
+        // streaming mode: scanning may remove bytes from the buffer, length is adjusted accordingly
+        consumed = signald_stream_handle(conn, conn->input_buffer, &length);
+    } else {
+        consumed = signald_handle_frames(conn, conn->input_buffer, length, scan_offset);
+    }
+    memmove(conn->input_buffer, conn->input_buffer + consumed, length - consumed);
+    conn->input_buffer_length = length - consumed;
+    return !signald_input_budget_exhausted(conn);
+}
+
+/*
+ * Continues handling the frames which have been deferred by @signald_input_defer.
+ * Reading from signald is resumed as soon as the backlog has been handled.
+ */
+static gboolean
+signald_input_backlog_cb(gpointer data)
+{
+    SignaldConnection *conn = data;
+    signald_input_budget_reset(conn, TRUE);
+    if (!signald_input_process(conn, 0)) {
+        return TRUE; // there is more, come back later
+    }
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Backlog of %u frames has been handled.\n", conn->input_backlog_frames);
+    conn->input_backlog_frames = 0;
+    conn->input_backlog_timer = 0;
+    conn->watcher = purple_input_add(conn->fd, PURPLE_INPUT_READ, signald_read_cb, conn);
+    return FALSE;
+}
+
+/*
+ * Stops reading from signald and handles the remaining frames in the input buffer a bit later.
+ * This way, the main loop (and the UI) stays responsive even if signald sends a lot of frames at once.
+ */
+static void
+signald_input_defer(SignaldConnection *conn)
+{
+    if (conn->watcher) {
+        purple_input_remove(conn->watcher);
+        conn->watcher = 0;
+    }
+    // count the remaining frames for the user's information
+    guint frames = 0;
+    const char *end = conn->input_buffer + conn->input_buffer_length;
+    for (const char *newline = memchr(conn->input_buffer, '\n', conn->input_buffer_length); newline != NULL; newline = memchr(newline + 1, '\n', end - newline - 1)) {
+        frames++;
+    }
+    conn->input_backlog_frames += frames;
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Deferring %u frames (%" G_GSIZE_FORMAT " bytes).\n", frames, conn->input_buffer_length);
+    if (conn->input_backlog_timer == 0) {
+        conn->input_backlog_timer = purple_timeout_add(0, signald_input_backlog_cb, conn);
+    }
+}
+
+/*
+ * Stops handling the backlog asynchronously.
+ * The deferred frames stay in the buffer (and input_backlog_frames stays set), so a later synchronous read handles them.
+ */
+void
+signald_input_backlog_destroy(SignaldConnection *conn)
+{
+    if (conn->input_backlog_timer) {
+        purple_timeout_remove(conn->input_backlog_timer);
+        conn->input_backlog_timer = 0;
+    }
+}
+
+/*
+ * Handles all complete frames in the input buffer right away, regardless of the work budget.
+ * Used for frames the worker thread handed back when it stopped.
+ */
+void
+signald_input_flush(SignaldConnection *conn)
+{
+    signald_input_budget_reset(conn, FALSE);
+    signald_input_process(conn, 0);
+}
+
+/*
+ * Starts handling input from the freshly connected socket.
+ * Reading and parsing happens in the worker thread if it is enabled, in the main loop otherwise.
+ */
+void
+signald_input_start(SignaldConnection *conn)
+{
+    conn->readflags = MSG_DONTWAIT;
+    if (conn->input_worker && signald_worker_start(conn->input_worker, conn->fd)) {
+        return;
+    }
+    conn->watcher = purple_input_add(conn->fd, PURPLE_INPUT_READ, signald_read_cb, conn);
+}
+
+/*
+ * Stops handling input asynchronously. signald_read_cb may be called synchronously afterwards.
+ */
+void
+signald_input_stop(SignaldConnection *conn)
+{
+    if (conn->watcher) {
+        purple_input_remove(conn->watcher);
+        conn->watcher = 0;
+    }
+    if (conn->input_worker) {
+        signald_worker_stop(conn->input_worker);
+    }
+}
+
 /*
  * Implements the read callback.
  * Called when data has been sent by signald and is ready to be handled.
  */
-void
-signald_read_cb(gpointer data, gint source, PurpleInputCondition cond)
+static void
+signald_read(SignaldConnection *conn)
 {
-    SignaldAccount *sa = data;
-    // this function essentially just reads bytes into a buffer until a newline is reached
-    // apparently, this callback is executed every 8k butes. therefore, input_buffer must be persistent accross calls
+    // this function reads as many bytes as are available into a buffer and handles the complete frames in it
+    // apparently, this callback is executed every 8k butes. a frame may be split accross calls. therefore, input_buffer must be persistent accross calls
     // using getline would be cool, but I do not want to find out what happens if I wrap this fd into a FILE* while the purple handle is connected to it
-    gssize read = recv(sa->fd, sa->input_buffer_position, 1, sa->readflags); // read one byte at a time (sometimes blocking according to sa->readflags)
-    while (read > 0) {
-        sa->input_buffer_position += read;
-        if(sa->input_buffer_position[-1] == '\n') {
-            *sa->input_buffer_position = 0;
-            purple_debug_info(SIGNALD_PLUGIN_ID, "got newline delimited message: %s", sa->input_buffer);
-            signald_parse_input(sa, sa->input_buffer, sa->input_buffer_position - sa->input_buffer - 1);
-            // reset buffer write pointer
-            sa->input_buffer_position = sa->input_buffer;
-        }
-        if (sa->input_buffer_position - sa->input_buffer + 1 == SIGNALD_INPUT_BUFSIZE) {
-            purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "message exceeded buffer size");
-            // reset buffer write pointer
+    int flags = conn->readflags; // first read is sometimes blocking according to conn->readflags
+    signald_input_budget_reset(conn, flags & MSG_DONTWAIT); // blocking reads must handle all frames
+    gssize read = 0;
+    do {
+        // one byte is always kept for the null-termination
+        if (conn->input_buffer_length + 1 == conn->input_buffer_size && !signald_input_buffer_grow(conn)) {
+            signald_connection_error(conn, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "message exceeded buffer size");
+            // reset buffer
             // should not have any effect since the connection will be destroyed, but better safe than sorry
-            sa->input_buffer_position = sa->input_buffer;
+            conn->input_buffer_length = 0;
             return;
         }
-        read = recv(sa->fd, sa->input_buffer_position, 1, MSG_DONTWAIT); // try to read another byte (continue the while loop)
-    }
+        gint64 recv_start = signald_trace_begin();
+        read = recv(conn->fd, conn->input_buffer + conn->input_buffer_length, conn->input_buffer_size - 1 - conn->input_buffer_length, flags);
+        signald_trace_end("recv", NULL, recv_start);
+        flags = MSG_DONTWAIT; // try to read more bytes (continue the loop)
+        if (read > 0 && conn->input_record) {
+            fwrite(conn->input_buffer + conn->input_buffer_length, 1, read, conn->input_record);
+        }
+        if (read > 0) {
+            // deferred frames (if any) have not been handled, yet – they need to be searched, too
+            // this is also the case after the backlog has been destroyed for a final synchronous read
+            gsize scan_offset = conn->input_backlog_frames > 0 ? 0 : conn->input_buffer_length;
+            conn->input_buffer_length += read;
+            if (!signald_input_process(conn, scan_offset)) {
+                // budget exhausted, do not read any more for now
+                signald_input_defer(conn);
+                return;
+            }
+            if (conn->input_backlog_timer == 0) {
+                conn->input_backlog_frames = 0; // a backlog left by signald_input_backlog_destroy has been handled now
+            }
+        }
+    } while (read > 0);
+    signald_input_buffer_shrink(conn);
     if (read == 0) {
-        purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "Connection to signald lost.");
+        signald_connection_error(conn, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "Connection to signald lost.");
     }
     if (read < 0) {
         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
@@ -51,62 +327,414 @@ signald_read_cb(gpointer data, gint source, PurpleInputCondition cond)
     }
 }
 
+void
+signald_read_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+    gint64 start = signald_trace_begin();
+    signald_read(data);
+    signald_trace_end("signald_read_cb", NULL, start);
+}
+
+/*
+ * Returns an empty buffer for an outgoing frame. Buffers of frames which have been written are re-used.
+ */
+static GString *
+signald_output_buffer_new(SignaldConnection *conn)
+{
+    GString *buffer = g_queue_pop_head(conn->output_pool);
+    if (buffer == NULL) {
+        buffer = g_string_sized_new(SIGNALD_OUTPUT_BUFFER_SIZE);
+    }
+    return buffer;
+}
+
+/*
+ * Keeps the buffer of a frame which has been written for re-use, unless enough buffers are kept already.
+ */
+static void
+signald_output_buffer_release(SignaldConnection *conn, GString *buffer)
+{
+    if (g_queue_get_length(conn->output_pool) < SIGNALD_OUTPUT_POOL_LENGTH && buffer->allocated_len <= SIGNALD_OUTPUT_POOL_MAX_CAPACITY) {
+        g_string_truncate(buffer, 0);
+        g_queue_push_head(conn->output_pool, buffer);
+    } else {
+        g_string_free(buffer, TRUE);
+    }
+}
+
+static void
+signald_output_free(GString *s)
+{
+    g_string_free(s, TRUE);
+}
+
+void
+signald_output_queue_init(SignaldConnection *conn)
+{
+    conn->output_queue = g_queue_new();
+    conn->output_pool = g_queue_new();
+    conn->output_queue_bytes = 0;
+    conn->output_offset = 0;
+    conn->output_watcher = 0;
+    conn->output_congested = FALSE;
+}
+
+void
+signald_output_queue_destroy(SignaldConnection *conn)
+{
+    if (conn->output_watcher) {
+        purple_input_remove(conn->output_watcher);
+        conn->output_watcher = 0;
+    }
+    if (conn->output_queue_bytes > 0) {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Discarding %u unsent messages (%" G_GSIZE_FORMAT " bytes).\n", g_queue_get_length(conn->output_queue), conn->output_queue_bytes);
+    }
+    g_queue_free_full(conn->output_queue, (GDestroyNotify)signald_output_free);
+    conn->output_queue = NULL;
+    g_queue_free_full(conn->output_pool, (GDestroyNotify)signald_output_free);
+    conn->output_pool = NULL;
+    conn->output_queue_bytes = 0;
+}
+
+/*
+ * Updates the congestion state according to the watermarks.
+ * Between the watermarks, the previous state persists.
+ */
+static void
+signald_output_update_congestion(SignaldConnection *conn)
+{
+    if (!conn->output_congested && conn->output_queue_bytes > SIGNALD_OUTPUT_HIGH_WATERMARK) {
+        conn->output_congested = TRUE;
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "signald is not keeping up. %u messages (%" G_GSIZE_FORMAT " bytes) are waiting to be sent.\n", g_queue_get_length(conn->output_queue), conn->output_queue_bytes);
+    } else if (conn->output_congested && conn->output_queue_bytes < SIGNALD_OUTPUT_LOW_WATERMARK) {
+        conn->output_congested = FALSE;
+        purple_debug_info(SIGNALD_PLUGIN_ID, "signald is keeping up again. %u messages (%" G_GSIZE_FORMAT " bytes) are waiting to be sent.\n", g_queue_get_length(conn->output_queue), conn->output_queue_bytes);
+    }
+}
+
 gboolean
-signald_send_str(SignaldAccount *sa, char *s)
+signald_output_congested(SignaldAccount *sa)
 {
-    int l = strlen(s);
-    int w = write(sa->fd, s, l);
-    if (w != l) {
-        purple_debug_info(SIGNALD_PLUGIN_ID, "wrote %d, wanted %d, error is %s\n", w, l, strerror(errno));
-        return 0;
+    return sa->connection->output_congested;
+}
+
+/*
+ * Writes as much of the queued data as the socket accepts without blocking (unless told to block).
+ * Returns FALSE in case of an error. errno is set accordingly.
+ */
+static gboolean
+signald_output_flush(SignaldConnection *conn, gboolean blocking)
+{
+    int flags = MSG_NOSIGNAL | (blocking ? 0 : MSG_DONTWAIT);
+    while (!g_queue_is_empty(conn->output_queue)) {
+        GString *head = g_queue_peek_head(conn->output_queue);
+        gssize w = send(conn->fd, head->str + conn->output_offset, head->len - conn->output_offset, flags);
+        if (w < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                // socket is full, continue when signald has read some data
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            } else {
+                purple_debug_error(SIGNALD_PLUGIN_ID, "send error is %s\n", strerror(errno));
+                return FALSE;
+            }
+        }
+        conn->output_offset += w;
+        conn->output_queue_bytes -= w;
+        if (conn->output_offset == head->len) {
+            signald_output_buffer_release(conn, g_queue_pop_head(conn->output_queue));
+            conn->output_offset = 0;
+        }
     }
-    return 1;
+    signald_output_update_congestion(conn);
+    return TRUE;
 }
 
+/*
+ * Implements the write callback.
+ * Called when the socket accepts data again after a partial write.
+ */
+static void
+signald_write_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+    SignaldConnection *conn = data;
+    if (!signald_output_flush(conn, FALSE)) {
+        purple_input_remove(conn->output_watcher);
+        conn->output_watcher = 0;
+        signald_connection_error(conn, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "Could not write to signald.");
+        return;
+    }
+    if (g_queue_is_empty(conn->output_queue)) {
+        // everything has been written, no need to watch any longer
+        purple_input_remove(conn->output_watcher);
+        conn->output_watcher = 0;
+    }
+}
+
+/*
+ * Writes all queued data, blocking until done.
+ * Used when the connection is about to be closed.
+ */
 gboolean
-signald_send_json(SignaldAccount *sa, JsonObject *data)
+signald_output_flush_blocking(SignaldConnection *conn)
+{
+    return signald_output_flush(conn, TRUE);
+}
+
+/*
+ * Queues a frame for sending, taking ownership of it. Writes immediately as far as possible.
+ * The rest is written by signald_write_cb once the socket accepts more data.
+ */
+static gboolean
+signald_output_enqueue(SignaldConnection *conn, GString *frame)
 {
+    if (conn->fd < 0) {
+        signald_output_buffer_release(conn, frame);
+        errno = ENOTCONN;
+        return FALSE;
+    }
+    gsize l = frame->len;
+    g_queue_push_tail(conn->output_queue, frame);
+    conn->output_queue_bytes += l;
+    if (conn->output_watcher == 0) {
+        // nothing is pending, try to write right away
+        if (!signald_output_flush(conn, FALSE)) {
+            purple_debug_info(SIGNALD_PLUGIN_ID, "wanted to write %" G_GSIZE_FORMAT " bytes, error is %s\n", l, strerror(errno));
+            return FALSE;
+        }
+        if (!g_queue_is_empty(conn->output_queue)) {
+            conn->output_watcher = purple_input_add(conn->fd, PURPLE_INPUT_WRITE, signald_write_cb, conn);
+        }
+    } else {
+        signald_output_update_congestion(conn);
+    }
+    return TRUE;
+}
+
+/*
+ * A request which has been sent to signald and is waiting for its response.
+ * Requests without a callback are tracked, too, so their responses can be routed to the account which sent them.
+ */
+typedef struct {
+    SignaldAccount *sa; // the account which sent the request
+    gchar *type; // for logging
+    gint64 deadline; // monotonic time in microseconds
+    SignaldResponseCallback callback; // may be NULL
+    gpointer user_data;
+    GDestroyNotify destroy;
+} SignaldRequest;
+
+static void
+signald_request_free(SignaldRequest *request)
+{
+    if (request->destroy) {
+        request->destroy(request->user_data);
+    }
+    g_free(request->type);
+    g_free(request);
+}
+
+void
+signald_requests_init(SignaldConnection *conn)
+{
+    conn->next_request_id = 1;
+    conn->pending_requests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)signald_request_free);
+    conn->pending_requests_timer = 0;
+}
+
+void
+signald_requests_destroy(SignaldConnection *conn)
+{
+    if (conn->pending_requests_timer) {
+        purple_timeout_remove(conn->pending_requests_timer);
+        conn->pending_requests_timer = 0;
+    }
+    g_hash_table_unref(conn->pending_requests);
+    conn->pending_requests = NULL;
+}
+
+static gboolean
+signald_request_sent_by(gpointer id, gpointer value, gpointer sa)
+{
+    SignaldRequest *request = value;
+    return request->sa == sa;
+}
+
+/*
+ * Forgets the requests an account has sent. Their callbacks are not invoked.
+ * Used when the account leaves the connection.
+ */
+void
+signald_requests_drop_account(SignaldConnection *conn, SignaldAccount *sa)
+{
+    g_hash_table_foreach_remove(conn->pending_requests, signald_request_sent_by, sa);
+}
+
+/*
+ * Returns the account which sent the request with the given id, NULL if there is no such request.
+ */
+SignaldAccount *
+signald_requests_lookup_account(SignaldConnection *conn, const char *id)
+{
+    SignaldRequest *request = g_hash_table_lookup(conn->pending_requests, id);
+    return request ? request->sa : NULL;
+}
+
+/*
+ * Informs the callbacks of requests which did not receive a response in time.
+ * The timer stops as soon as no requests are pending.
+ */
+static gboolean
+signald_requests_check_timeouts(gpointer data)
+{
+    SignaldConnection *conn = data;
+    gint64 now = g_get_monotonic_time();
+    // expired requests are collected first since callbacks may send new requests
+    GList *expired = NULL;
+    GHashTableIter iter;
+    gpointer id, value;
+    g_hash_table_iter_init(&iter, conn->pending_requests);
+    while (g_hash_table_iter_next(&iter, &id, &value)) {
+        SignaldRequest *request = value;
+        if (request->deadline <= now) {
+            purple_debug_warning(SIGNALD_PLUGIN_ID, "Request %s (%s) timed out.\n", (char *)id, request->type);
+            expired = g_list_prepend(expired, request);
+            g_hash_table_iter_steal(&iter);
+            g_free(id);
+        }
+    }
+    for (GList *elem = expired; elem != NULL; elem = elem->next) {
+        SignaldRequest *request = elem->data;
+        if (request->callback) {
+            request->callback(request->sa, NULL, request->user_data);
+        }
+    }
+    g_list_free_full(expired, (GDestroyNotify)signald_request_free);
+    if (g_hash_table_size(conn->pending_requests) == 0) {
+        conn->pending_requests_timer = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Hands a response to the callback of the request it belongs to.
+ * Returns FALSE in case the response does not belong to a pending request with a callback.
+ * If the response carries an error, the request is dropped without invoking its callback.
+ */
+gboolean
+signald_handle_response(SignaldAccount *sa, JsonObject *obj, gboolean is_error)
+{
+    GHashTable *pending_requests = sa->connection->pending_requests;
+    JsonNode *id_node = json_object_get_member(obj, "id");
+    if (id_node == NULL || !JSON_NODE_HOLDS_VALUE(id_node) || json_node_get_value_type(id_node) != G_TYPE_STRING) {
+        return FALSE;
+    }
+    gpointer id = NULL;
+    gpointer value = NULL;
+    if (!g_hash_table_lookup_extended(pending_requests, json_node_get_string(id_node), &id, &value)) {
+        return FALSE;
+    }
+    SignaldRequest *request = value;
+    // remove the request from the table before invoking the callback since it may send new requests
+    g_hash_table_steal(pending_requests, id);
+    g_free(id);
+    gboolean handled = !is_error && request->callback != NULL;
+    if (handled) {
+        request->callback(sa, obj, request->user_data);
+    }
+    signald_request_free(request);
+    return handled;
+}
+
+/*
+ * Sends a request to signald. Every request is tagged with a unique id.
+ * If a callback is given, it is invoked with the response. Other responses are handled according to their type.
+ * In case signald does not respond within SIGNALD_REQUEST_TIMEOUT_SECONDS, the callback is invoked with NULL instead.
+ * The request takes ownership of user_data. destroy is called when the request is done (or could not be sent).
+ */
+gboolean
+signald_send_request(SignaldAccount *sa, JsonObject *data, SignaldResponseCallback callback, gpointer user_data, GDestroyNotify destroy)
+{
+    SignaldConnection *conn = sa->connection;
+    if (conn->sandbox) {
+        // nothing is sent, so no response will arrive and the callback is never invoked
+        conn->sandbox_requests++;
+        if (destroy) {
+            destroy(user_data);
+        }
+        return TRUE;
+    }
     // Set version to v1
     json_object_set_string_member(data, "version", "v1");
+    gchar *id = g_strdup_printf("%u", conn->next_request_id++);
+    json_object_set_string_member(data, "id", id);
+
+    // serialize the request including its newline, so the frame is written at once
+    GString *frame = signald_output_buffer_new(conn);
+    signald_json_write_object(frame, data);
+    g_string_append_c(frame, '\n');
+    if (purple_debug_is_verbose()) {
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Sending: %s", frame->str);
+    }
+    signald_flight_recorder_add(conn, TRUE, data, frame->len);
+    signald_metrics_request_sent(json_object_get_string_member(data, "type"), frame->len);
+    gboolean success = signald_output_enqueue(conn, frame);
 
-    gboolean success;
-    char *json = json_object_to_string(data);
-    purple_debug_info(SIGNALD_PLUGIN_ID, "Sending: %s\n", json);
-    success = signald_send_str(sa, json);
     if (success) {
-        success = signald_send_str(sa, "\n");
+        SignaldRequest *request = g_new0(SignaldRequest, 1);
+        request->sa = sa;
+        request->type = g_strdup(json_object_get_string_member(data, "type"));
+        request->deadline = g_get_monotonic_time() + SIGNALD_REQUEST_TIMEOUT_SECONDS * G_USEC_PER_SEC;
+        request->callback = callback;
+        request->user_data = user_data;
+        request->destroy = destroy;
+        g_hash_table_insert(conn->pending_requests, id, request);
+        if (conn->pending_requests_timer == 0) {
+            conn->pending_requests_timer = purple_timeout_add_seconds(1, signald_requests_check_timeouts, conn);
+        }
+    } else {
+        if (destroy) {
+            int error = errno; // keep errno for the caller
+            destroy(user_data);
+            errno = error;
+        }
+        g_free(id);
     }
-    g_free(json);
     return success;
 }
 
 gboolean
-signald_send_json_or_display_error(SignaldAccount *sa, JsonObject *data)
+signald_send_json(SignaldAccount *sa, JsonObject *data)
+{
+    return signald_send_request(sa, data, NULL, NULL, NULL);
+}
+
+gboolean
+signald_send_request_or_display_error(SignaldAccount *sa, JsonObject *data, SignaldResponseCallback callback, gpointer user_data, GDestroyNotify destroy)
 {
-    if (!signald_send_json(sa, data)) {
+    if (!signald_send_request(sa, data, callback, user_data, destroy)) {
         const gchar *type = json_object_get_string_member(data, "type");
         char *error_message = g_strdup_printf("Could not write %s message.", type);
+        signald_flight_recorder_dump(sa->connection, error_message);
         purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error_message);
         g_free(error_message);
+        return FALSE;
     }
+    return TRUE;
+}
+
+gboolean
+signald_send_json_or_display_error(SignaldAccount *sa, JsonObject *data)
+{
+    return signald_send_request_or_display_error(sa, data, NULL, NULL, NULL);
 }
 
 gchar *
 json_object_to_string(JsonObject *obj)
 {
-    JsonNode *node;
-    gchar *str;
-    JsonGenerator *generator;
-
-    node = json_node_new(JSON_NODE_OBJECT);
-    json_node_set_object(node, obj);
-
-    // a json string ...
-    generator = json_generator_new();
-    json_generator_set_root(generator, node);
-    str = json_generator_to_data(generator, NULL);
-    g_object_unref(generator);
-    json_node_free(node);
-
-    return str;
+    GString *str = g_string_new(NULL);
+    signald_json_write_object(str, obj);
+    return g_string_free(str, FALSE);
 }
@@ -6,11 +6,82 @@
 gchar *
 json_object_to_string(JsonObject *obj);
 
+void
+signald_output_queue_init(SignaldConnection *conn);
+
+void
+signald_output_queue_destroy(SignaldConnection *conn);
+
+gboolean
+signald_output_congested(SignaldAccount *sa);
+
+gboolean
+signald_output_flush_blocking(SignaldConnection *conn);
+
+/*
+ * Invoked with the response to a request. response is NULL in case the request timed out.
+ */
+typedef void (*SignaldResponseCallback)(SignaldAccount *sa, JsonObject *response, gpointer user_data);
+
+void
+signald_requests_init(SignaldConnection *conn);
+
+void
+signald_requests_destroy(SignaldConnection *conn);
+
+void
+signald_requests_drop_account(SignaldConnection *conn, SignaldAccount *sa);
+
+SignaldAccount *
+signald_requests_lookup_account(SignaldConnection *conn, const char *id);
+
+gboolean
+signald_handle_response(SignaldAccount *sa, JsonObject *obj, gboolean is_error);
+
+gboolean
+signald_send_request(SignaldAccount *sa, JsonObject *data, SignaldResponseCallback callback, gpointer user_data, GDestroyNotify destroy);
+
 gboolean
 signald_send_json(SignaldAccount *sa, JsonObject *data);
 
+gboolean
+signald_send_request_or_display_error(SignaldAccount *sa, JsonObject *data, SignaldResponseCallback callback, gpointer user_data, GDestroyNotify destroy);
+
 gboolean
 signald_send_json_or_display_error(SignaldAccount *sa, JsonObject *data);
 
+void
+signald_input_buffer_init(SignaldConnection *conn);
+
+void
+signald_input_buffer_destroy(SignaldConnection *conn);
+
+gboolean
+signald_input_buffer_append(SignaldConnection *conn, const char *data, gsize length);
+
+void
+signald_handle_frame(SignaldConnection *conn, char *frame, gsize length);
+
+void
+signald_input_budget_reset(SignaldConnection *conn, gboolean limited);
+
+void
+signald_input_budget_spend(SignaldConnection *conn);
+
+gboolean
+signald_input_budget_exhausted(SignaldConnection *conn);
+
+void
+signald_input_backlog_destroy(SignaldConnection *conn);
+
+void
+signald_input_flush(SignaldConnection *conn);
+
+void
+signald_input_start(SignaldConnection *conn);
+
+void
+signald_input_stop(SignaldConnection *conn);
+
 void
 signald_read_cb(gpointer data, gint source, PurpleInputCondition cond);
@@ -0,0 +1,589 @@
+#include <sys/un.h> // for sockaddr_un
+#include <sys/socket.h> // for socket and read
+#include <sys/inotify.h> // for watching the socket directories
+#include <errno.h>
+#include <fcntl.h>
+#include "connection.h"
+#include "purple_compat.h"
+#include "defines.h"
+#include "comms.h"
+#include "input.h"
+#include "link.h"
+#include "stream.h"
+#include "worker.h"
+#include "json-utils.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flight-recorder.h"
+
+/*
+ * Connections to signald are shared by all accounts which use the same socket location.
+ * signald tags requests and events with the account they belong to, so one socket suffices.
+ *
+ * Incoming frames are routed
+ *
+ * * to the account which sent the request in case the frame is a response (by id),
+ * * to the account named in the frame's account member,
+ * * to all accounts in case the frame does not name an account (e.g. the version message).
+ *
+ * The connection is configured with the options of the account which opens it.
+ */
+
+static GHashTable *signald_connections = NULL; // socket location → SignaldConnection
+
+/*
+ * A socket location signald may listen at.
+ */
+typedef struct {
+    gchar *socket_path;
+    int fd; // socket with a connection in progress, -1 otherwise
+    guint watcher; // write watcher for the connection in progress
+    gboolean watching_directory; // whether the socket's directory itself (rather than its parent) is being watched
+} SignaldSocketCandidate;
+
+/*
+ * State of connecting to signald. Everything happens on the main thread.
+ *
+ * Connecting is attempted with non-blocking sockets. Attempts are repeated whenever something changes in the directories
+ * the sockets are expected in (as reported by inotify), so the connection is made as soon as signald creates its socket.
+ * In case inotify is not available, attempts are repeated every second.
+ */
+struct SignaldConnector {
+    GList *candidates; // of SignaldSocketCandidate
+    int inotify_fd; // -1 if inotify is not available
+    guint inotify_watcher;
+    guint retry_timer; // only used without inotify
+    guint timeout_timer;
+    gint64 start_time; // monotonic time at which connecting started
+};
+
+static void
+signald_socket_candidate_abort(SignaldSocketCandidate *candidate)
+{
+    if (candidate->watcher) {
+        purple_input_remove(candidate->watcher);
+        candidate->watcher = 0;
+    }
+    if (candidate->fd >= 0) {
+        close(candidate->fd);
+        candidate->fd = -1;
+    }
+}
+
+static void
+signald_socket_candidate_free(gpointer data)
+{
+    SignaldSocketCandidate *candidate = data;
+    signald_socket_candidate_abort(candidate);
+    g_free(candidate->socket_path);
+    g_free(candidate);
+}
+
+/*
+ * Stops all connection attempts.
+ */
+static void
+signald_connector_destroy(SignaldConnection *conn)
+{
+    SignaldConnector *connector = conn->connector;
+    if (connector == NULL) {
+        return;
+    }
+    g_list_free_full(connector->candidates, signald_socket_candidate_free);
+    if (connector->inotify_watcher) {
+        purple_input_remove(connector->inotify_watcher);
+    }
+    if (connector->inotify_fd >= 0) {
+        close(connector->inotify_fd);
+    }
+    if (connector->retry_timer) {
+        purple_timeout_remove(connector->retry_timer);
+    }
+    if (connector->timeout_timer) {
+        purple_timeout_remove(connector->timeout_timer);
+    }
+    g_free(connector);
+    conn->connector = NULL;
+}
+
+/*
+ * Takes over the connected socket of a candidate. All other attempts are stopped.
+ */
+static void
+signald_connector_succeed(SignaldConnection *conn, SignaldSocketCandidate *candidate)
+{
+    int fd = candidate->fd;
+    candidate->fd = -1; // do not close on destruction
+    gint64 duration = g_get_monotonic_time() - conn->connector->start_time;
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Connected to %s after %" G_GINT64_FORMAT " ms.\n", candidate->socket_path, duration / 1000);
+    signald_connector_destroy(conn);
+
+    // reads and writes are non-blocking by flags, the socket itself must block for the synchronous read on close
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    conn->fd = fd;
+    signald_metrics_increment(SIGNALD_METRIC_CONNECTS);
+    signald_input_start(conn);
+}
+
+static void
+signald_socket_candidate_connected_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+    SignaldConnection *conn = data;
+    for (GList *iter = conn->connector->candidates; iter != NULL; iter = iter->next) {
+        SignaldSocketCandidate *candidate = iter->data;
+        if (candidate->fd == source) {
+            int err = 0;
+            socklen_t len = sizeof err;
+            if (getsockopt(source, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                signald_connector_succeed(conn, candidate);
+            } else {
+                purple_debug_info(SIGNALD_PLUGIN_ID, "Connecting to %s failed: %s\n", candidate->socket_path, strerror(err));
+                signald_socket_candidate_abort(candidate);
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Starts a non-blocking connection attempt unless one is in progress already.
+ * Returns TRUE in case the connection has been established right away.
+ */
+static gboolean
+signald_socket_candidate_try(SignaldConnection *conn, SignaldSocketCandidate *candidate)
+{
+    if (candidate->fd >= 0) {
+        return FALSE;
+    }
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strcpy(address.sun_path, candidate->socket_path); // length has been checked in signald_connection_connect
+    candidate->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (candidate->fd < 0) {
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Could not create socket: %s\n", strerror(errno));
+        return FALSE;
+    }
+    if (connect(candidate->fd, (struct sockaddr *) &address, sizeof address) == 0) {
+        signald_connector_succeed(conn, candidate);
+        return TRUE;
+    }
+    if (errno == EINPROGRESS) {
+        candidate->watcher = purple_input_add(candidate->fd, PURPLE_INPUT_WRITE, signald_socket_candidate_connected_cb, conn);
+    } else {
+        // most likely, the socket does not exist (yet) – wait for a change
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Connecting to %s: %s\n", candidate->socket_path, strerror(errno));
+        signald_socket_candidate_abort(candidate);
+    }
+    return FALSE;
+}
+
+/*
+ * Watches the directory the socket is expected in. In case it does not exist, yet, its parent is watched instead.
+ */
+static void
+signald_socket_candidate_watch(SignaldConnector *connector, SignaldSocketCandidate *candidate)
+{
+    if (connector->inotify_fd < 0 || candidate->watching_directory) {
+        return;
+    }
+    gchar *directory = g_path_get_dirname(candidate->socket_path);
+    if (inotify_add_watch(connector->inotify_fd, directory, IN_CREATE | IN_MOVED_TO | IN_ATTRIB) >= 0) {
+        candidate->watching_directory = TRUE;
+    } else {
+        gchar *parent = g_path_get_dirname(directory);
+        if (inotify_add_watch(connector->inotify_fd, parent, IN_CREATE | IN_MOVED_TO) < 0) {
+            purple_debug_warning(SIGNALD_PLUGIN_ID, "Cannot watch %s: %s\n", parent, strerror(errno));
+        }
+        g_free(parent);
+    }
+    g_free(directory);
+}
+
+/*
+ * Tries all candidates which are not connecting already.
+ */
+static void
+signald_connector_try_all(SignaldConnection *conn)
+{
+    for (GList *iter = conn->connector->candidates; iter != NULL; iter = iter->next) {
+        SignaldSocketCandidate *candidate = iter->data;
+        signald_socket_candidate_watch(conn->connector, candidate);
+        if (signald_socket_candidate_try(conn, candidate)) {
+            return; // connector has been destroyed
+        }
+    }
+}
+
+static void
+signald_connector_inotify_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+    SignaldConnection *conn = data;
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (read(source, events, sizeof events) > 0) {
+        // the events themselves are not of interest, anything might have changed
+    }
+    signald_connector_try_all(conn);
+}
+
+static gboolean
+signald_connector_retry_cb(gpointer data)
+{
+    SignaldConnection *conn = data;
+    signald_connector_try_all(conn);
+    return conn->connector != NULL;
+}
+
+static gboolean
+signald_connector_timeout_cb(gpointer data)
+{
+    SignaldConnection *conn = data;
+    conn->connector->timeout_timer = 0;
+    signald_connector_destroy(conn);
+    signald_connection_error(conn, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "Unable to connect to any socket location.");
+    return FALSE;
+}
+
+static void
+signald_connector_add(SignaldConnector *connector, gchar *socket_path)
+{
+    SignaldSocketCandidate *candidate = g_new0(SignaldSocketCandidate, 1);
+    candidate->socket_path = socket_path;
+    candidate->fd = -1;
+    connector->candidates = g_list_append(connector->candidates, candidate);
+}
+
+/*
+ * Connects to signald socket.
+ * Tries multiple possible default socket location at once.
+ * In case the user has explicitly defined a socket location, only that one is considered.
+ */
+static void
+signald_connection_connect(SignaldConnection *conn) {
+    conn->fd = -1; // socket is not connected, no valid value for fd, yet
+
+    SignaldConnector *connector = g_new0(SignaldConnector, 1);
+    connector->inotify_fd = -1;
+    connector->start_time = g_get_monotonic_time();
+    conn->connector = connector;
+
+    if (conn->key[0]) {
+        signald_connector_add(connector, g_strdup(conn->key));
+    } else {
+        const gchar *xdg_runtime_dir = g_getenv("XDG_RUNTIME_DIR");
+        if (xdg_runtime_dir) {
+            signald_connector_add(connector, g_strdup_printf("%s/%s", xdg_runtime_dir, SIGNALD_GLOBAL_SOCKET_FILE));
+        } else {
+            purple_debug_warning(SIGNALD_PLUGIN_ID, "Unable to read environment variable XDG_RUNTIME_DIR. Skipping the related socket location.\n");
+        }
+        signald_connector_add(connector, g_strdup_printf("%s/%s", SIGNALD_GLOBAL_SOCKET_PATH_VAR, SIGNALD_GLOBAL_SOCKET_FILE));
+    }
+
+    struct sockaddr_un address;
+    for (GList *iter = connector->candidates; iter != NULL; iter = iter->next) {
+        SignaldSocketCandidate *candidate = iter->data;
+        if (strlen(candidate->socket_path) >= sizeof address.sun_path) {
+            gchar *errmsg = g_strdup_printf("socket path %s exceeds maximum length %lu!\n", candidate->socket_path, sizeof address.sun_path);
+            signald_connector_destroy(conn);
+            signald_connection_error(conn, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, errmsg);
+            g_free(errmsg);
+            return;
+        }
+    }
+
+    connector->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (connector->inotify_fd >= 0) {
+        connector->inotify_watcher = purple_input_add(connector->inotify_fd, PURPLE_INPUT_READ, signald_connector_inotify_cb, conn);
+    } else {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "inotify is not available (%s), polling for the socket instead.\n", strerror(errno));
+        connector->retry_timer = purple_timeout_add_seconds(1, signald_connector_retry_cb, conn);
+    }
+    connector->timeout_timer = purple_timeout_add_seconds(SIGNALD_TIMEOUT_SECONDS, signald_connector_timeout_cb, conn);
+
+    signald_connector_try_all(conn);
+}
+
+
+/*
+ * Raises a connection error on all accounts using the connection.
+ * The connection is not offered to accounts logging in afterwards.
+ */
+void
+signald_connection_error(SignaldConnection *conn, PurpleConnectionError reason, const char *message)
+{
+    if (signald_connections && g_hash_table_lookup(signald_connections, conn->key) == conn) {
+        g_hash_table_remove(signald_connections, conn->key);
+    }
+    signald_metrics_increment(SIGNALD_METRIC_CONNECTION_ERRORS);
+    signald_flight_recorder_dump(conn, message);
+    for (GList *iter = conn->accounts; iter != NULL; iter = iter->next) {
+        SignaldAccount *sa = iter->data;
+        purple_connection_error(sa->pc, reason, message);
+    }
+}
+
+/*
+ * Returns the account with the given identifier (UUID or number).
+ * In case no identifier is given and only one account uses the connection, that account is returned.
+ * Returns NULL if there is no such account.
+ */
+SignaldAccount *
+signald_connection_find_account(SignaldConnection *conn, const char *account)
+{
+    if (conn->sandbox) {
+        // replayed input is meant for the sandbox account, whichever account it has been recorded for
+        return conn->accounts ? conn->accounts->data : NULL;
+    }
+    if (account == NULL) {
+        if (conn->accounts != NULL && conn->accounts->next == NULL) {
+            return conn->accounts->data;
+        }
+        return NULL;
+    }
+    for (GList *iter = conn->accounts; iter != NULL; iter = iter->next) {
+        SignaldAccount *sa = iter->data;
+        if (purple_strequal(account, sa->uuid) || purple_strequal(account, purple_account_get_username(sa->account))) {
+            return sa;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Hands a parsed frame (length bytes in its serialized form) to the account(s) it is meant for.
+ */
+void
+signald_connection_dispatch(SignaldConnection *conn, JsonNode *root, gsize length)
+{
+    if (!JSON_NODE_HOLDS_OBJECT(root)) {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignoring message which is not an object.\n");
+        return;
+    }
+    JsonObject *obj = json_node_get_object(root);
+    if (conn->sandbox) {
+        conn->sandbox_frames++;
+    }
+    SignaldAccount *sa = NULL;
+    const char *id = json_object_get_string_member_or_null(obj, "id");
+    if (id != NULL) {
+        sa = signald_requests_lookup_account(conn, id);
+        if (sa == NULL && !conn->sandbox) {
+            // the request timed out or its account left the connection, nobody else is interested in the response
+            purple_debug_info(SIGNALD_PLUGIN_ID, "Ignoring response to request %s which is not pending.\n", id);
+            return;
+        }
+    }
+    const char *account = json_object_get_string_member_or_null(obj, "account");
+    if (sa == NULL) {
+        sa = signald_connection_find_account(conn, account);
+    }
+    // the type is copied since handlers may modify the frame
+    gchar *type = g_strdup(json_object_get_string_member_or_null(obj, "type"));
+    gint64 trace_start = signald_trace_begin();
+    gint64 start = g_get_monotonic_time();
+    if (sa != NULL) {
+        signald_handle_input(sa, root);
+    } else if (account == NULL) {
+        for (GList *iter = conn->accounts; iter != NULL; iter = iter->next) {
+            signald_handle_input(iter->data, root);
+        }
+    } else {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignoring message for unknown account %s.\n", account);
+    }
+    signald_metrics_frame_handled(type, length, g_get_monotonic_time() - start);
+    signald_trace_end("handle", type, trace_start);
+    g_free(type);
+}
+
+/*
+ * Parses one frame and dispatches it.
+ */
+void
+signald_connection_parse(SignaldConnection *conn, const char *json, gssize length)
+{
+    JsonParser *parser = json_parser_new();
+    gint64 start = signald_trace_begin();
+    gboolean parsed = json_parser_load_from_data(parser, json, length, NULL);
+    signald_trace_end("parse", NULL, start);
+    if (!parsed) {
+        signald_connection_error(conn, PURPLE_CONNECTION_ERROR_OTHER_ERROR, "Error parsing input.");
+    } else {
+        JsonNode *root = json_parser_get_root(parser);
+        if (root == NULL) {
+            signald_connection_error(conn, PURPLE_CONNECTION_ERROR_OTHER_ERROR, "root node is NULL.");
+        } else {
+            signald_connection_dispatch(conn, root, length < 0 ? strlen(json) : (gsize)length);
+        }
+    }
+    g_object_unref(parser);
+}
+
+/*
+ * Creates a connection configured with the options of the given account. It is not connected, yet.
+ */
+static SignaldConnection *
+signald_connection_new(const char *key, PurpleAccount *account)
+{
+    SignaldConnection *conn = g_new0(SignaldConnection, 1);
+    conn->key = g_strdup(key);
+    int limit_mib = purple_account_get_int(account, SIGNALD_OPTION_INPUT_BUFFER_LIMIT, SIGNALD_INPUT_BUFSIZE_LIMIT_DEFAULT);
+    conn->input_buffer_limit = MAX((gsize)MAX(limit_mib, 0) * 1024 * 1024, SIGNALD_INPUT_BUFSIZE_INITIAL);
+    conn->input_budget_frames_limit = purple_account_get_int(account, SIGNALD_OPTION_INPUT_FRAME_BUDGET, SIGNALD_INPUT_FRAME_BUDGET_DEFAULT);
+    conn->input_budget_milliseconds_limit = purple_account_get_int(account, SIGNALD_OPTION_INPUT_TIME_BUDGET, SIGNALD_INPUT_TIME_BUDGET_DEFAULT);
+    signald_input_buffer_init(conn);
+    signald_output_queue_init(conn);
+    signald_requests_init(conn);
+    if (purple_account_get_bool(account, SIGNALD_OPTION_INPUT_THREAD, FALSE)) {
+        // incremental processing is not available in the worker thread
+        conn->input_worker = signald_worker_new(conn);
+    } else if (purple_account_get_bool(account, SIGNALD_OPTION_STREAM_INPUT, FALSE)) {
+        conn->input_stream = signald_stream_new();
+    }
+    const char *record_file = purple_account_get_string(account, SIGNALD_OPTION_RECORD_FILE, "");
+    if (record_file && record_file[0]) {
+        conn->input_record = fopen(record_file, "a");
+        if (conn->input_record == NULL) {
+            purple_debug_error(SIGNALD_PLUGIN_ID, "Cannot record to %s: %s\n", record_file, strerror(errno));
+        }
+    }
+    signald_metrics_exporter_start(conn, account);
+    int flight_recorder_frames = purple_account_get_int(account, SIGNALD_OPTION_FLIGHT_RECORDER_FRAMES, SIGNALD_FLIGHT_RECORDER_FRAMES_DEFAULT);
+    if (flight_recorder_frames > 0) {
+        conn->flight_recorder = signald_flight_recorder_new(flight_recorder_frames, purple_account_get_bool(account, SIGNALD_OPTION_FLIGHT_RECORDER_REDACT, TRUE));
+    }
+    const char *trace_file = purple_account_get_string(account, SIGNALD_OPTION_TRACE_FILE, "");
+    if (trace_file && trace_file[0]) {
+        conn->trace = signald_trace_open(trace_file);
+    }
+    return conn;
+}
+
+static void
+signald_connection_free(SignaldConnection *conn)
+{
+    signald_connector_destroy(conn);
+    signald_metrics_exporter_stop(conn);
+    signald_input_stop(conn);
+    signald_input_backlog_destroy(conn);
+    signald_output_queue_destroy(conn);
+    signald_requests_destroy(conn);
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    if (conn->sandbox) {
+        close(conn->sandbox_peer);
+    }
+    signald_input_buffer_destroy(conn);
+    if (conn->input_stream) {
+        signald_stream_free(conn->input_stream);
+        conn->input_stream = NULL;
+    }
+    if (conn->input_worker) {
+        signald_worker_free(conn->input_worker);
+        conn->input_worker = NULL;
+    }
+    if (conn->input_record) {
+        fclose(conn->input_record);
+        conn->input_record = NULL;
+    }
+    if (conn->trace) {
+        signald_trace_close();
+    }
+    if (conn->flight_recorder) {
+        signald_flight_recorder_free(conn->flight_recorder);
+        conn->flight_recorder = NULL;
+    }
+    g_free(conn->key);
+    g_free(conn);
+}
+
+/*
+ * Attaches the account to the connection for its socket location. The connection is opened if necessary.
+ */
+void
+signald_connection_acquire(SignaldAccount *sa)
+{
+    purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTING);
+    const char *key = purple_account_get_string(sa->account, "socket", "");
+    if (key == NULL) {
+        key = "";
+    }
+    if (signald_connections == NULL) {
+        signald_connections = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    SignaldConnection *conn = g_hash_table_lookup(signald_connections, key);
+    if (conn == NULL) {
+        conn = signald_connection_new(key, sa->account);
+        signald_connection_connect(conn);
+        g_hash_table_insert(signald_connections, conn->key, conn);
+        sa->connection = conn;
+        conn->accounts = g_list_append(conn->accounts, sa);
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Opened new connection to signald.\n");
+    } else {
+        sa->connection = conn;
+        conn->accounts = g_list_append(conn->accounts, sa);
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Sharing connection to signald with %u other accounts.\n", g_list_length(conn->accounts) - 1);
+        if (conn->fd >= 0) {
+            // signald greeted this connection already, continue like after the version message
+            signald_request_accounts(sa);
+        }
+    }
+}
+
+/*
+ * Attaches the account to a sandbox connection of its own. It is never connected to signald.
+ * Instead, it reads from one end of a socket pair. Input written to the other end (sandbox_peer)
+ * is handled like input from signald: by signald_read_cb or the worker thread, depending on the account's options.
+ * Requests are not sent (and their callbacks never invoked).
+ * Used for replaying recorded input, see harness.c.
+ * Returns FALSE in case the socket pair cannot be created.
+ */
+gboolean
+signald_connection_acquire_sandbox(SignaldAccount *sa)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Cannot create sandbox socket: %s\n", strerror(errno));
+        return FALSE;
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    SignaldConnection *conn = signald_connection_new("", sa->account);
+    conn->fd = fds[0];
+    conn->sandbox = TRUE;
+    conn->sandbox_peer = fds[1];
+    sa->connection = conn;
+    conn->accounts = g_list_append(conn->accounts, sa);
+    signald_input_start(conn);
+    return TRUE;
+}
+
+/*
+ * Returns whether the account is the only one using its connection.
+ */
+gboolean
+signald_connection_is_exclusive(SignaldAccount *sa)
+{
+    GList *accounts = sa->connection->accounts;
+    return accounts != NULL && accounts->data == sa && accounts->next == NULL;
+}
+
+/*
+ * Detaches the account from its connection. The connection is closed when the last account leaves.
+ * Requests the account has sent are forgotten.
+ */
+void
+signald_connection_release(SignaldAccount *sa)
+{
+    SignaldConnection *conn = sa->connection;
+    sa->connection = NULL;
+    signald_requests_drop_account(conn, sa);
+    if (conn->input_stream) {
+        signald_stream_drop_account(conn->input_stream, sa);
+    }
+    conn->accounts = g_list_remove(conn->accounts, sa);
+    if (conn->accounts == NULL) {
+        if (signald_connections && g_hash_table_lookup(signald_connections, conn->key) == conn) {
+            g_hash_table_remove(signald_connections, conn->key);
+        }
+        signald_connection_free(conn);
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "structs.h"
+
+void signald_connection_acquire(SignaldAccount *sa);
+
+gboolean signald_connection_acquire_sandbox(SignaldAccount *sa);
+
+void signald_connection_release(SignaldAccount *sa);
+
+gboolean signald_connection_is_exclusive(SignaldAccount *sa);
+
+SignaldAccount * signald_connection_find_account(SignaldConnection *conn, const char *account);
+
+void signald_connection_dispatch(SignaldConnection *conn, JsonNode *root, gsize length);
+
+void signald_connection_parse(SignaldConnection *conn, const char *json, gssize length);
+
+void signald_connection_error(SignaldConnection *conn, PurpleConnectionError reason, const char *message);
@@ -123,15 +123,47 @@ signald_parse_contact_list(SignaldAccount *sa, JsonArray *profiles)
     //TODO: mark buddies not in contact list but in buddy list as "deleted"
 }
 
+static void
+signald_profile_cb(SignaldAccount *sa, JsonObject *response, gpointer user_data);
+
+/*
+ * Sends a request for a contact's profile. The response is handed to @signald_process_profile.
+ */
+static void
+signald_send_profile_request(SignaldAccount *sa, const char *who, gboolean show)
+{
+    g_return_if_fail(sa->uuid);
+    JsonObject *data = json_object_new();
+    json_object_set_string_member(data, "type", "get_profile");
+    json_object_set_string_member(data, "account", sa->uuid);
+    JsonObject *address = json_object_new();
+    json_object_set_string_member(address, "uuid", who);
+    json_object_set_object_member(data, "address", address);
+    signald_send_request_or_display_error(sa, data, signald_profile_cb, GINT_TO_POINTER(show), NULL);
+    json_object_unref(data);
+}
+
+/*
+ * Handles the response to a request sent by @signald_send_profile_request.
+ */
+static void
+signald_profile_cb(SignaldAccount *sa, JsonObject *response, gpointer user_data)
+{
+    if (response == NULL) {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "signald did not send the requested profile in time.\n");
+    } else {
+        signald_process_profile(sa, json_object_get_object_member(response, "data"), GPOINTER_TO_INT(user_data));
+    }
+}
+
 /*
  * Purple UI function: Request information about a contact for showing it to the user.
  * 
- * See @signald_request_profile for details.
+ * See @signald_process_profile for details.
  */
 void signald_get_info(PurpleConnection *pc, const char *who) {
     SignaldAccount *sa = purple_connection_get_protocol_data(pc);
-    sa->show_profile = g_strdup(who);
-    signald_request_profile(pc, who);
+    signald_send_profile_request(sa, who, TRUE);
 }
 
 /*
@@ -141,15 +173,7 @@ void signald_get_info(PurpleConnection *pc, const char *who) {
  */
 void signald_request_profile(PurpleConnection *pc, const char *who) {
     SignaldAccount *sa = purple_connection_get_protocol_data(pc);
-    g_return_if_fail(sa->uuid);
-    JsonObject *data = json_object_new();
-    json_object_set_string_member(data, "type", "get_profile");
-    json_object_set_string_member(data, "account", sa->uuid);
-    JsonObject *address = json_object_new();
-    json_object_set_string_member(address, "uuid", who);
-    json_object_set_object_member(data, "address", address);
-    signald_send_json_or_display_error(sa, data);
-    json_object_unref(data);
+    signald_send_profile_request(sa, who, FALSE);
 }
 
 /*
@@ -175,17 +199,15 @@ signald_process_profile_info_member(JsonObject *object, const gchar *member_name
 /*
  * Process contact profile information.
  * 
- * May be either displayed to the user via @signald_show_profile or used to update non-buddy group chat participant name, see @signald_update_participant_name.
+ * May be either displayed to the user via @signald_show_profile (if show is set) or used to update non-buddy group chat participant name, see @signald_update_participant_name.
  */
-void signald_process_profile(SignaldAccount *sa, JsonObject *obj) {
+void signald_process_profile(SignaldAccount *sa, JsonObject *obj, gboolean show) {
     JsonObject *address = json_object_get_object_member(obj, "address");
     g_return_if_fail(address);
     const char *uuid = json_object_get_string_member(address, "uuid");
     g_return_if_fail(uuid && uuid[0]);
     
-    if (sa->show_profile) {
-        g_free(sa->show_profile);
-        sa->show_profile = NULL;
+    if (show) {
         signald_show_profile(sa->pc, uuid, obj);
     } else {
         signald_update_participant_name(uuid, obj);
@@ -5,13 +5,15 @@
 
 void signald_assume_all_buddies_state(SignaldAccount *sa);
 
+void signald_process_contact(SignaldAccount *sa, JsonNode *node);
+
 void signald_parse_contact_list(SignaldAccount *sa, JsonArray *profiles);
 
 void signald_get_info(PurpleConnection *pc, const char *who);
 
 void signald_request_profile(PurpleConnection *pc, const char *who);
 
-void signald_process_profile(SignaldAccount *sa, JsonObject *obj);
+void signald_process_profile(SignaldAccount *sa, JsonObject *obj, gboolean show);
 
 void signald_show_profile(PurpleConnection *pc, const char *uuid, JsonObject *obj);
 
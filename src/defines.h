@@ -12,6 +12,27 @@
 #define SIGNALD_DEFAULT_DEVICENAME "Signal-Purple-Plugin" // must fit in HOST_NAME_MAX
 
 #define SIGNALD_TIMEOUT_SECONDS 10
+#define SIGNALD_REQUEST_TIMEOUT_SECONDS 60 // time signald has to respond to a request
+#define SIGNALD_INPUT_BUFSIZE_INITIAL 16384 // the input buffer starts with this size and shrinks back to it
+#define SIGNALD_INPUT_BUFSIZE_LIMIT_DEFAULT 64 // in MiB, maximum size of the input buffer unless configured otherwise
+#define SIGNALD_INPUT_FRAME_BUDGET_DEFAULT 100 // frames handled per main loop iteration unless configured otherwise
+#define SIGNALD_INPUT_TIME_BUDGET_DEFAULT 50 // in ms, time spent on handling frames per main loop iteration unless configured otherwise
+#define SIGNALD_OUTPUT_BUFFER_SIZE 512 // initial capacity of a buffer for an outgoing frame
+#define SIGNALD_OUTPUT_POOL_LENGTH 16 // number of buffers for outgoing frames kept for re-use
+#define SIGNALD_OUTPUT_POOL_MAX_CAPACITY 65536 // larger buffers for outgoing frames are not kept for re-use
+#define SIGNALD_FLIGHT_RECORDER_FRAMES_DEFAULT 256 // frames kept by the flight recorder unless configured otherwise
+#define SIGNALD_FLIGHT_RECORDER_EXCERPT 1024 // in bytes, maximum length of a frame's excerpt in the flight recorder
+#define SIGNALD_FLIGHT_RECORDER_FILE "signald-flight-recorder.log" // in purple's user directory
+#define SIGNALD_REPLY_CACHE_BYTES_PER_MESSAGE 1024 // for converting the obsolete reply cache capacity into a size (including the index)
+#define SIGNALD_MSGLOG_EXCERPT_LENGTH 40 // in characters, for referring to logged messages
+#define SIGNALD_RECEIPTS_BATCH_SIZE 50 // receipts for one recipient are sent once this many are pending
+#define SIGNALD_RECEIPTS_MAX_AGE_DEFAULT 10 // in seconds, receipts are sent after waiting this long unless configured otherwise
+#define SIGNALD_SENT_MESSAGES_MAX 500 // number of sent messages whose receipts are tracked
+#define SIGNALD_RECEIVED_MESSAGES_MAX 500 // number of received messages whose conversation and read state are remembered
+#define SIGNALD_RECEIPTS_DISPLAY_DELAY_MS 2000 // receipts arriving within this time are shown together
+#define SIGNALD_METRICS_INTERVAL_SECONDS 15 // interval for exporting metrics to a file
+#define SIGNALD_OUTPUT_HIGH_WATERMARK 1048576 // in bytes, non-essential requests are deferred while more data is waiting to be sent
+#define SIGNALD_OUTPUT_LOW_WATERMARK 262144 // in bytes, deferred requests are resumed when less data is waiting to be sent
 #define SIGNALD_GLOBAL_SOCKET_FILE  "signald/signald.sock"
 #define SIGNALD_GLOBAL_SOCKET_PATH_VAR "/var/run"
 
@@ -31,5 +52,19 @@
 
 #define SIGNALD_OPTION_WAIT_SEND_ACKNOWLEDEMENT "wait-send-acknowledgement"
 #define SIGNALD_OPTION_MARK_READ "mark-read"
+#define SIGNALD_OPTION_RECEIPTS_MAX_AGE "receipts-max-age"
 #define SIGNALD_OPTION_DISPLAY_RECEIPTS "display-receipts"
-#define SIGNALD_OPTION_REPLY_CACHE "reply-cache-capacity"
+#define SIGNALD_OPTION_REPLY_CACHE "reply-cache-capacity" // obsolete, replaced by SIGNALD_OPTION_REPLY_CACHE_SIZE
+#define SIGNALD_OPTION_REPLY_CACHE_SIZE "reply-cache-size"
+#define SIGNALD_OPTION_MESSAGE_LOG_SIZE "message-log-size"
+#define SIGNALD_OPTION_INPUT_BUFFER_LIMIT "input-buffer-limit"
+#define SIGNALD_OPTION_STREAM_INPUT "stream-input"
+#define SIGNALD_OPTION_INPUT_FRAME_BUDGET "input-frame-budget"
+#define SIGNALD_OPTION_INPUT_TIME_BUDGET "input-time-budget"
+#define SIGNALD_OPTION_INPUT_THREAD "input-thread"
+#define SIGNALD_OPTION_RECORD_FILE "record-file"
+#define SIGNALD_OPTION_METRICS_FILE "metrics-file"
+#define SIGNALD_OPTION_METRICS_SOCKET "metrics-socket"
+#define SIGNALD_OPTION_TRACE_FILE "trace-file"
+#define SIGNALD_OPTION_FLIGHT_RECORDER_FRAMES "flight-recorder-frames"
+#define SIGNALD_OPTION_FLIGHT_RECORDER_REDACT "flight-recorder-redact"
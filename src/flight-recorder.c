@@ -0,0 +1,181 @@
+#include <errno.h>
+#include "flight-recorder.h"
+#include "purple_compat.h"
+#include "defines.h"
+#include "json-writer.h"
+
+/*
+ * Keeps the most recent frames in both directions, so there is something to look at after an incident
+ * without logging every frame.
+ *
+ * Every record holds the time, direction, length and an excerpt of the frame (optionally redacted).
+ * The buffers of the excerpts are re-used as the ring wraps around.
+ * The recorder is dumped into a file (and the debug log) when the connection fails, and on demand.
+ */
+
+typedef struct {
+    gint64 time; // wall-clock time in µs
+    gboolean outgoing;
+    gsize length; // length of the frame in bytes
+    GString *excerpt;
+} SignaldFlightRecord;
+
+struct SignaldFlightRecorder {
+    SignaldFlightRecord *records;
+    guint capacity;
+    guint next; // index of the record to be overwritten next
+    guint count; // number of records in use
+    gboolean redact;
+};
+
+SignaldFlightRecorder *
+signald_flight_recorder_new(guint capacity, gboolean redact)
+{
+    SignaldFlightRecorder *recorder = g_new0(SignaldFlightRecorder, 1);
+    recorder->records = g_new0(SignaldFlightRecord, capacity);
+    recorder->capacity = capacity;
+    recorder->redact = redact;
+    return recorder;
+}
+
+void
+signald_flight_recorder_free(SignaldFlightRecorder *recorder)
+{
+    for (guint i = 0; i < recorder->capacity; i++) {
+        if (recorder->records[i].excerpt) {
+            g_string_free(recorder->records[i].excerpt, TRUE);
+        }
+    }
+    g_free(recorder->records);
+    g_free(recorder);
+}
+
+/*
+ * Takes the oldest record for a frame of length bytes. Its excerpt is empty.
+ */
+static SignaldFlightRecord *
+signald_flight_recorder_next(SignaldFlightRecorder *recorder, gboolean outgoing, gsize length)
+{
+    SignaldFlightRecord *record = &recorder->records[recorder->next];
+    recorder->next = (recorder->next + 1) % recorder->capacity;
+    recorder->count = MIN(recorder->count + 1, recorder->capacity);
+    record->time = g_get_real_time();
+    record->outgoing = outgoing;
+    record->length = length;
+    if (record->excerpt == NULL || record->excerpt->allocated_len > 2 * SIGNALD_FLIGHT_RECORDER_EXCERPT) {
+        // a single long string may have blown up the buffer
+        if (record->excerpt) {
+            g_string_free(record->excerpt, TRUE);
+        }
+        record->excerpt = g_string_sized_new(SIGNALD_FLIGHT_RECORDER_EXCERPT);
+    }
+    g_string_truncate(record->excerpt, 0);
+    return record;
+}
+
+static void
+signald_flight_recorder_truncate(SignaldFlightRecord *record)
+{
+    if (record->excerpt->len > SIGNALD_FLIGHT_RECORDER_EXCERPT) {
+        g_string_truncate(record->excerpt, SIGNALD_FLIGHT_RECORDER_EXCERPT);
+        g_string_append(record->excerpt, "…");
+    }
+}
+
+/*
+ * Records a parsed frame of length bytes.
+ */
+void
+signald_flight_recorder_add(SignaldConnection *conn, gboolean outgoing, JsonObject *obj, gsize length)
+{
+    SignaldFlightRecorder *recorder = conn->flight_recorder;
+    if (recorder == NULL) {
+        return;
+    }
+    SignaldFlightRecord *record = signald_flight_recorder_next(recorder, outgoing, length);
+    signald_json_write_excerpt(record->excerpt, obj, SIGNALD_FLIGHT_RECORDER_EXCERPT, recorder->redact);
+    signald_flight_recorder_truncate(record);
+}
+
+/*
+ * Records an incoming frame before it is parsed, so frames which cannot be parsed show up as well.
+ * length is the length of the entire frame, data may be a truncated copy of data_length bytes.
+ */
+void
+signald_flight_recorder_add_raw(SignaldConnection *conn, const char *data, gsize data_length, gsize length)
+{
+    SignaldFlightRecorder *recorder = conn->flight_recorder;
+    if (recorder == NULL) {
+        return;
+    }
+    SignaldFlightRecord *record = signald_flight_recorder_next(recorder, FALSE, length);
+    signald_json_write_raw_excerpt(record->excerpt, data, data_length, SIGNALD_FLIGHT_RECORDER_EXCERPT, recorder->redact);
+    signald_flight_recorder_truncate(record);
+}
+
+/*
+ * Formats all records, oldest first.
+ */
+static GString *
+signald_flight_recorder_format(SignaldFlightRecorder *recorder)
+{
+    GString *out = g_string_new(NULL);
+    guint first = (recorder->next + recorder->capacity - recorder->count) % recorder->capacity;
+    for (guint i = 0; i < recorder->count; i++) {
+        SignaldFlightRecord *record = &recorder->records[(first + i) % recorder->capacity];
+        GDateTime *time = g_date_time_new_from_unix_local(record->time / G_USEC_PER_SEC);
+        gchar *formatted = g_date_time_format(time, "%F %T");
+        g_string_append_printf(out, "%s.%06" G_GINT64_FORMAT " %s %" G_GSIZE_FORMAT " bytes %s\n",
+            formatted, record->time % G_USEC_PER_SEC, record->outgoing ? ">>" : "<<", record->length, record->excerpt->str);
+        g_free(formatted);
+        g_date_time_unref(time);
+    }
+    return out;
+}
+
+/*
+ * Writes the records into SIGNALD_FLIGHT_RECORDER_FILE in purple's user directory and into the debug log.
+ */
+void
+signald_flight_recorder_dump(SignaldConnection *conn, const char *reason)
+{
+    SignaldFlightRecorder *recorder = conn->flight_recorder;
+    if (recorder == NULL || recorder->count == 0) {
+        return;
+    }
+    GString *dump = signald_flight_recorder_format(recorder);
+    g_string_prepend(dump, "\n");
+    g_string_prepend(dump, reason);
+    gchar *path = g_build_filename(purple_user_dir(), SIGNALD_FLIGHT_RECORDER_FILE, NULL);
+    GError *error = NULL;
+    if (!g_file_set_contents(path, dump->str, dump->len, &error)) {
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Cannot write %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
+    if (purple_debug_is_enabled()) {
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Last %u frames (%s):\n%s", recorder->count, path, dump->str);
+    }
+    g_free(path);
+    g_string_free(dump, TRUE);
+}
+
+/*
+ * Shows the records of the account's connection.
+ */
+void
+signald_flight_recorder_action(PurpleConnection *pc)
+{
+    SignaldAccount *sa = purple_connection_get_protocol_data(pc);
+    SignaldFlightRecorder *recorder = sa->connection->flight_recorder;
+    if (recorder == NULL) {
+        purple_notify_info(pc, SIGNALD_DIALOG_TITLE, "Flight recorder", "The flight recorder is disabled in the account options.");
+        return;
+    }
+    GString *dump = signald_flight_recorder_format(recorder);
+    gchar *escaped = g_markup_escape_text(dump->str, dump->len);
+    gchar *html = purple_strreplace(escaped, "\n", "<br>");
+    purple_notify_formatted(pc, SIGNALD_DIALOG_TITLE, "Flight recorder", purple_account_get_username(sa->account), html, NULL, NULL);
+    g_free(html);
+    g_free(escaped);
+    g_string_free(dump, TRUE);
+}
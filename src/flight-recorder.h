@@ -0,0 +1,15 @@
+#pragma once
+
+#include "structs.h"
+
+SignaldFlightRecorder * signald_flight_recorder_new(guint capacity, gboolean redact);
+
+void signald_flight_recorder_free(SignaldFlightRecorder *recorder);
+
+void signald_flight_recorder_add(SignaldConnection *conn, gboolean outgoing, JsonObject *obj, gsize length);
+
+void signald_flight_recorder_add_raw(SignaldConnection *conn, const char *data, gsize data_length, gsize length);
+
+void signald_flight_recorder_dump(SignaldConnection *conn, const char *reason);
+
+void signald_flight_recorder_action(PurpleConnection *pc);
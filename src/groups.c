@@ -72,17 +72,15 @@ GList *
 signald_members_to_uuids(JsonArray *members)
 {
     GList *uuids = NULL;
+    GList *elements = json_array_get_elements(members);
 
-    for (
-        GList *this_member = json_array_get_elements(members);
-        this_member != NULL;
-        this_member = this_member->next
-    ) {
+    for (GList *this_member = elements; this_member != NULL; this_member = this_member->next) {
         JsonNode *element = (JsonNode *)(this_member->data);
         char *uuid = signald_get_group_member_uuid(element);
-        uuids = g_list_append(uuids, g_strdup(uuid));
+        uuids = g_list_prepend(uuids, g_strdup(uuid));
     }
-    return uuids;
+    g_list_free(elements);
+    return g_list_reverse(uuids);
 }
 
 gboolean
@@ -113,23 +111,30 @@ signald_accept_groupV2_invitation(SignaldAccount *sa, const char *groupId, JsonA
 }
 
 /*
- * This handles incoming Signal group information,
- * overwriting participant lists where appropriate.
+ * Updates the participants of an active chat to the given members.
+ * Only the difference is applied: Members who left are removed and new ones are added, each in one batch.
+ * The chat's participants are looked up in libpurple's own index, so the cost depends on the size of the group, not its square.
  */
-// TODO: a soft "remove who left, add who was added" would be nicer than
-// this blunt-force "remove everyone and re-add" approach
-// TODO: use purple_conv_chat_add_users since purple_conv_chat_add_user uses it anyway
 void
 signald_chat_set_participants(PurpleAccount *account, const char *groupId, JsonArray *members) {
-    GList *uuids = signald_members_to_uuids(members);
     PurpleConvChat *conv_chat = purple_conversations_find_chat_with_account(groupId, account);
-    if (conv_chat != NULL) { // only consider active chats
-        purple_conv_chat_clear_users(conv_chat);
-        for (GList * uuid_elem = uuids; uuid_elem != NULL; uuid_elem = uuid_elem->next) {
-            const char* uuid = uuid_elem->data;
-            PurpleConvChatBuddyFlags flags = 0;
-            purple_conv_chat_add_user(conv_chat, uuid, NULL, flags, FALSE);
-            
+    if (conv_chat == NULL) { // only consider active chats
+        return;
+    }
+    // the set of members, uuids point into the JSON
+    GHashTable *current = g_hash_table_new(g_str_hash, g_str_equal);
+    GList *elements = json_array_get_elements(members);
+    GList *joined = NULL;
+    GList *flags = NULL;
+    for (GList *this_member = elements; this_member != NULL; this_member = this_member->next) {
+        char *uuid = signald_get_group_member_uuid(this_member->data);
+        if (uuid == NULL || g_hash_table_contains(current, uuid)) {
+            continue; // listed already
+        }
+        g_hash_table_add(current, uuid);
+        if (!purple_conv_chat_find_user(conv_chat, uuid)) {
+            joined = g_list_prepend(joined, uuid);
+            flags = g_list_prepend(flags, GINT_TO_POINTER(PURPLE_CBFLAGS_NONE));
             if (!purple_find_buddy(account, uuid)) {
                 // this UUID is not known – request the profile for display of friendly name
                 PurpleConnection *pc = purple_account_get_connection(account);
@@ -137,7 +142,27 @@ signald_chat_set_participants(PurpleAccount *account, const char *groupId, JsonA
             }
         }
     }
-    g_list_free_full(uuids, g_free);
+    g_list_free(elements);
+
+    GList *left = NULL;
+    for (GList *user = purple_conv_chat_get_users(conv_chat); user != NULL; user = user->next) {
+        const char *name = purple_conv_chat_cb_get_name(user->data);
+        if (!g_hash_table_contains(current, name)) {
+            // copied since the buddies are destroyed before the UI is notified
+            left = g_list_prepend(left, g_strdup(name));
+        }
+    }
+    if (left != NULL) {
+        purple_conv_chat_remove_users(conv_chat, left, NULL);
+    }
+    if (joined != NULL) {
+        joined = g_list_reverse(joined);
+        purple_conv_chat_add_users(conv_chat, joined, NULL, flags, FALSE);
+    }
+    g_list_free_full(left, g_free);
+    g_list_free(joined);
+    g_list_free(flags);
+    g_hash_table_destroy(current);
 }
 
 void
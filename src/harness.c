@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "harness.h"
+#include "purple_compat.h"
+#include "defines.h"
+#include "login.h"
+#include "connection.h"
+
+/*
+ * A headless libpurple core for running the plugin outside of Pidgin (see replay.c and benchmark.c).
+ *
+ * The plugin is registered as a static protocol (libsignald.c is compiled with PURPLE_STATIC_PRPL).
+ * Accounts log in to a sandbox connection instead of signald, so nothing reaches signald or the user's accounts.
+ * Input for an account is written into the sandbox's socket, so it takes the same path as input from signald.
+ * Everything libpurple stores is kept in a temporary directory which is removed on shutdown.
+ * Set SIGNALD_HARNESS_DEBUG in the environment to see libpurple's debug output.
+ */
+
+#define SIGNALD_HARNESS_UI "signald-harness"
+
+gboolean purple_init_signald_plugin(void); // defined by PURPLE_INIT_PLUGIN
+
+static gchar *signald_harness_dir = NULL;
+
+typedef struct {
+    PurpleInputFunction function;
+    gpointer data;
+} SignaldHarnessInput;
+
+static gboolean
+signald_harness_input_cb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    SignaldHarnessInput *input = data;
+    PurpleInputCondition purple_condition = 0;
+    if (condition & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+        purple_condition |= PURPLE_INPUT_READ;
+    }
+    if (condition & (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+        purple_condition |= PURPLE_INPUT_WRITE;
+    }
+    input->function(input->data, g_io_channel_unix_get_fd(source), purple_condition);
+    return TRUE;
+}
+
+static guint
+signald_harness_input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function, gpointer data)
+{
+    SignaldHarnessInput *input = g_new0(SignaldHarnessInput, 1);
+    input->function = function;
+    input->data = data;
+    GIOCondition io_condition = 0;
+    if (condition & PURPLE_INPUT_READ) {
+        io_condition |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+    }
+    if (condition & PURPLE_INPUT_WRITE) {
+        io_condition |= G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+    }
+    GIOChannel *channel = g_io_channel_unix_new(fd);
+    guint id = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, io_condition, signald_harness_input_cb, input, g_free);
+    g_io_channel_unref(channel);
+    return id;
+}
+
+static PurpleEventLoopUiOps signald_harness_eventloop = {
+    .timeout_add = g_timeout_add,
+    .timeout_remove = g_source_remove,
+    .input_add = signald_harness_input_add,
+    .input_remove = g_source_remove,
+    .timeout_add_seconds = g_timeout_add_seconds,
+};
+
+/*
+ * Starts the core with a fresh configuration directory and registers the plugin.
+ */
+gboolean
+signald_harness_init(void)
+{
+    signald_harness_dir = g_dir_make_tmp("signald-harness-XXXXXX", NULL);
+    if (signald_harness_dir == NULL) {
+        fprintf(stderr, "Cannot create a temporary directory.\n");
+        return FALSE;
+    }
+    purple_util_set_user_dir(signald_harness_dir);
+    purple_debug_set_enabled(g_getenv("SIGNALD_HARNESS_DEBUG") != NULL);
+    purple_eventloop_set_ui_ops(&signald_harness_eventloop);
+    if (!purple_core_init(SIGNALD_HARNESS_UI)) {
+        fprintf(stderr, "Cannot initialize libpurple.\n");
+        return FALSE;
+    }
+    purple_set_blist(purple_blist_new());
+    if (!purple_init_signald_plugin()) {
+        fprintf(stderr, "Cannot register the plugin.\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+signald_harness_remove_dir(const char *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    if (dir != NULL) {
+        for (const char *name = g_dir_read_name(dir); name != NULL; name = g_dir_read_name(dir)) {
+            gchar *child = g_build_filename(path, name, NULL);
+            if (g_file_test(child, G_FILE_TEST_IS_DIR) && !g_file_test(child, G_FILE_TEST_IS_SYMLINK)) {
+                signald_harness_remove_dir(child);
+            } else {
+                g_remove(child);
+            }
+            g_free(child);
+        }
+        g_dir_close(dir);
+    }
+    g_rmdir(path);
+}
+
+void
+signald_harness_shutdown(void)
+{
+    purple_core_quit();
+    if (signald_harness_dir) {
+        signald_harness_remove_dir(signald_harness_dir);
+        g_free(signald_harness_dir);
+        signald_harness_dir = NULL;
+    }
+}
+
+/*
+ * Replaces signald_login for accounts of the harness.
+ */
+static void
+signald_harness_login(PurpleAccount *account)
+{
+    SignaldAccount *sa = signald_login_prepare(account);
+    sa->uuid = g_strdup(purple_account_get_username(account));
+    if (!signald_connection_acquire_sandbox(sa)) {
+        purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR, "Cannot create sandbox connection.");
+        return;
+    }
+    purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTED);
+}
+
+/*
+ * Sets an account option given as NAME=VALUE. Values true and false are booleans, numbers are integers.
+ */
+static gboolean
+signald_harness_set_option(PurpleAccount *account, const char *option)
+{
+    const char *equals = strchr(option, '=');
+    if (equals == NULL || equals == option) {
+        fprintf(stderr, "Option %s is not of the form NAME=VALUE.\n", option);
+        return FALSE;
+    }
+    gchar *name = g_strndup(option, equals - option);
+    const char *value = equals + 1;
+    char *end = NULL;
+    long number = strtol(value, &end, 10);
+    if (g_str_equal(value, "true") || g_str_equal(value, "false")) {
+        purple_account_set_bool(account, name, g_str_equal(value, "true"));
+    } else if (value[0] && *end == '\0') {
+        purple_account_set_int(account, name, number);
+    } else {
+        purple_account_set_string(account, name, value);
+    }
+    g_free(name);
+    return TRUE;
+}
+
+/*
+ * Creates an account with the given UUID and account options (NAME=VALUE, may be NULL) and logs it in to a sandbox connection.
+ * Returns NULL in case logging in failed.
+ */
+SignaldAccount *
+signald_harness_account_new(const char *uuid, gchar **options)
+{
+    PurplePluginProtocolInfo *prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO(purple_find_prpl(SIGNALD_PLUGIN_ID));
+    prpl_info->login = signald_harness_login;
+    PurpleAccount *account = purple_account_new(uuid, SIGNALD_PLUGIN_ID);
+    purple_accounts_add(account);
+    for (gchar **option = options; option != NULL && *option != NULL; option++) {
+        if (!signald_harness_set_option(account, *option)) {
+            purple_accounts_delete(account);
+            return NULL;
+        }
+    }
+    purple_account_set_enabled(account, SIGNALD_HARNESS_UI, TRUE);
+    if (purple_account_get_connection(account) == NULL) {
+        purple_account_connect(account);
+    }
+    PurpleConnection *pc = purple_account_get_connection(account);
+    return pc ? purple_connection_get_protocol_data(pc) : NULL;
+}
+
+/*
+ * Writes input into the account's sandbox socket and runs the main loop until the sandbox dispatched the given number of frames.
+ * Returns FALSE in case the connection failed (sa has been freed then) or writing failed.
+ */
+gboolean
+signald_harness_feed(SignaldAccount *sa, const char *data, gsize length, guint frames)
+{
+    PurpleAccount *account = sa->account;
+    SignaldConnection *conn = sa->connection;
+    guint expected = conn->sandbox_frames + frames;
+    gsize written = 0;
+    while (written < length || conn->sandbox_frames < expected) {
+        if (written < length) {
+            gssize result = write(conn->sandbox_peer, data + written, length - written);
+            if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "Cannot write into the sandbox: %s\n", g_strerror(errno));
+                return FALSE;
+            }
+            written += MAX(result, 0);
+        }
+        // wait for the sandbox to read (and handle) input, unless more can be written right away
+        g_main_context_iteration(NULL, written == length);
+        if (purple_account_is_disconnected(account) || purple_connection_get_state(sa->pc) != PURPLE_CONNECTION_CONNECTED) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Logs the account out (signald_close frees sa) and deletes it.
+ */
+void
+signald_harness_account_free(SignaldAccount *sa)
+{
+    PurpleAccount *account = sa->account;
+    purple_account_disconnect(account);
+    purple_accounts_delete(account);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "structs.h"
+
+gboolean signald_harness_init(void);
+
+void signald_harness_shutdown(void);
+
+SignaldAccount * signald_harness_account_new(const char *uuid, gchar **options);
+
+gboolean signald_harness_feed(SignaldAccount *sa, const char *data, gsize length, guint frames);
+
+void signald_harness_account_free(SignaldAccount *sa);
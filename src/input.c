@@ -8,15 +8,258 @@
 #include "contacts.h"
 #include "message.h"
 #include "login.h"
+#include "flight-recorder.h"
 #include "receipt.h"
+#include "comms.h"
 #include "json-utils.h"
 
+/*
+ * Handlers for the types of messages signald sends.
+ * Each one receives the entire message (not only its data member).
+ */
+
+static void
+signald_handle_version(SignaldAccount *sa, JsonObject *obj)
+{
+    obj = json_object_get_object_member(obj, "data");
+    purple_debug_info(SIGNALD_PLUGIN_ID, "signald version: %s\n", json_object_get_string_member(obj, "version"));
+    signald_request_accounts(sa); // Request information on accounts, including our own UUID.
+}
+
+static void
+signald_handle_list_accounts(SignaldAccount *sa, JsonObject *obj)
+{
+    JsonObject *data = json_object_get_object_member(obj, "data");
+    signald_parse_account_list(sa, json_object_get_array_member(data, "accounts"));
+}
+
+static void
+signald_handle_subscribe(SignaldAccount *sa, JsonObject *obj)
+{
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Subscribed!\n");
+    // request a sync from other devices
+    signald_request_sync(sa);
+}
+
+static void
+signald_handle_unsubscribe(SignaldAccount *sa, JsonObject *obj)
+{
+    purple_connection_set_state(sa->pc, PURPLE_CONNECTION_DISCONNECTED);
+}
+
+static void
+signald_handle_request_sync(SignaldAccount *sa, JsonObject *obj)
+{
+    // sync from other devices completed,
+    // now pull contacts and groups
+    signald_list_contacts(sa);
+    signald_request_group_list(sa);
+}
+
+static void
+signald_handle_list_contacts(SignaldAccount *sa, JsonObject *obj)
+{
+    obj = json_object_get_object_member(obj, "data");
+    signald_parse_contact_list(sa, json_object_get_array_member(obj,"profiles"));
+}
+
+static void
+signald_handle_internal_error(SignaldAccount *sa, JsonObject *obj)
+{
+    // TODO: find out which messages do have a "data" object and which do not
+    const char * message = json_object_get_string_member_or_null(obj, "message");
+    if (message == NULL) {
+        obj = json_object_get_object_member(obj, "data");
+        message = json_object_get_string_member_or_null(obj, "message");
+    }
+    if (purple_strequal(message, "org.whispersystems.signalservice.api.InvalidMessageStructureException: SyncMessage missing destination, group ID, and recipient manifest!")) {
+        // TODO: remove this special case after https://gitlab.com/signald/signald/-/issues/363 has been resolved
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignoring InvalidMessageStructureException.\n");
+    } else if (purple_strequal(message, "org.signal.libsignal.metadata.InvalidMetadataMessageException: org.signal.libsignal.protocol.InvalidMessageException: invalid sealed sender message: derived ephemeral key did not match key provided in message")) {
+        // this means a message could not be fully processed and henceforth will not be displayed
+        // the connection should not be terminated, though
+        //purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignoring InvalidMetadataMessageException.\n");
+        const gchar * username = purple_account_get_username(sa->account);
+        PurpleConversation * conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, username, sa->account);
+        if (conv == NULL) {
+            conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, sa->account, username);
+        }
+        purple_conversation_write(conv, NULL, "InvalidMessageException happened in signald. Please check your primary device if you have one. The message is lost for this client. I am sorry.", PURPLE_MESSAGE_ERROR, time(NULL));
+    } else {
+        signald_flight_recorder_dump(sa->connection, message);
+        purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR, message);
+    }
+}
+
+static void
+signald_handle_get_profile(SignaldAccount *sa, JsonObject *obj)
+{
+    obj = json_object_get_object_member(obj, "data");
+    signald_process_profile(sa, obj, FALSE); // response to a request which timed out
+}
+
+static void
+signald_handle_get_group(SignaldAccount *sa, JsonObject *obj)
+{
+    obj = json_object_get_object_member(obj, "data");
+    signald_process_groupV2_obj(sa, obj);
+}
+
+static void
+signald_handle_list_groups(SignaldAccount *sa, JsonObject *obj)
+{
+    obj = json_object_get_object_member(obj, "data");
+    signald_parse_groupV2_list(sa, json_object_get_array_member(obj, "groups"));
+}
+
+static void
+signald_handle_leave_group(SignaldAccount *sa, JsonObject *obj)
+{
+    obj = json_object_get_object_member(obj, "data");
+    signald_process_leave_group(sa, obj);
+}
+
+static void
+signald_handle_incoming_message(SignaldAccount *sa, JsonObject *obj)
+{
+    obj = json_object_get_object_member(obj, "data");
+    if (json_object_has_member(obj, "receipt_message")) {
+        signald_process_receipt(sa, obj);
+    } else if (json_object_has_member(obj, "typing_message")) {
+        signald_process_typing(sa, obj);
+    } else {
+        signald_process_message(sa, obj);
+    }
+}
+
+static void
+signald_handle_generate_linking_uri(SignaldAccount *sa, JsonObject *obj)
+{
+    signald_parse_linking_uri(sa, obj);
+}
+
+static void
+signald_handle_finish_link(SignaldAccount *sa, JsonObject *obj)
+{
+    signald_process_finish_link(sa, obj);
+}
+
+static void
+signald_handle_set_device_name(SignaldAccount *sa, JsonObject *obj)
+{
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Device name set successfully.\n");
+}
+
 static void
+signald_handle_send(SignaldAccount *sa, JsonObject *obj)
+{
+    // acknowledgements are handled by signald_send_acknowledged. this one arrived after the request timed out.
+    purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignoring late send acknowledgement.\n");
+}
+
+static void
+signald_handle_websocket_connection_state(SignaldAccount *sa, JsonObject *obj)
+{
+    JsonObject *data = json_object_get_object_member(obj, "data");
+    const gchar *state = json_object_get_string_member(data, "state");
+    if  (purple_strequal(state, "CONNECTED") && sa->uuid) {
+        purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTED);
+    } else if  (purple_strequal(state, "CONNECTING") && sa->uuid) {
+        purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTING);
+    } else if  (purple_strequal(state, "DISCONNECTED") && sa->uuid) {
+        // setting the connection state to DISCONNECTED invokes the destruction of the instance
+        // we probably do not want that (signald might already be doing a reconnect)
+        purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTING);
+        //purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "Disconnected.");
+    }
+}
+
+static void
+signald_handle_ignore(SignaldAccount *sa, JsonObject *obj)
+{
+    // mark_read: I do not really care if sending read receipts succeed.
+    // ListenerState: obsolete variant of WebSocketConnectionState. ignore silently.
+    // ProtocolInvalidKeyIdError: this one has boolean "error": true
+    // TODO: get sender, show notification
+}
+
+typedef void (*SignaldInputHandler)(SignaldAccount *sa, JsonObject *obj);
+
+typedef struct {
+    const char *type;
+    SignaldInputHandler handler;
+    guint64 count; // number of messages of this type handled so far (by all accounts)
+} SignaldInputType;
+
+/*
+ * Maps the types of messages to their handlers.
+ * The order does not matter, lookup is done via signald_input_type_table.
+ */
+static SignaldInputType signald_input_types[] = {
+    {"IncomingMessage", signald_handle_incoming_message},
+    {"send", signald_handle_send},
+    {"mark_read", signald_handle_ignore},
+    {"WebSocketConnectionState", signald_handle_websocket_connection_state},
+    {"get_profile", signald_handle_get_profile},
+    {"get_group", signald_handle_get_group},
+    {"list_groups", signald_handle_list_groups},
+    {"list_contacts", signald_handle_list_contacts},
+    {"leave_group", signald_handle_leave_group},
+    {"version", signald_handle_version},
+    {"list_accounts", signald_handle_list_accounts},
+    {"subscribe", signald_handle_subscribe},
+    {"unsubscribe", signald_handle_unsubscribe},
+    {"request_sync", signald_handle_request_sync},
+    {"InternalError", signald_handle_internal_error},
+    {"generate_linking_uri", signald_handle_generate_linking_uri},
+    {"finish_link", signald_handle_finish_link},
+    {"set_device_name", signald_handle_set_device_name},
+    {"ListenerState", signald_handle_ignore},
+    {"ProtocolInvalidKeyIdError", signald_handle_ignore},
+};
+
+static GHashTable *signald_input_type_table = NULL; // type string → SignaldInputType
+static guint64 signald_input_unknown_count = 0; // number of messages of unknown type
+
+static SignaldInputType *
+signald_input_type_lookup(const char *type)
+{
+    if (signald_input_type_table == NULL) {
+        signald_input_type_table = g_hash_table_new(g_str_hash, g_str_equal);
+        for (gsize i = 0; i < G_N_ELEMENTS(signald_input_types); i++) {
+            g_hash_table_insert(signald_input_type_table, (gpointer)signald_input_types[i].type, &signald_input_types[i]);
+        }
+    }
+    if (type == NULL) {
+        return NULL;
+    }
+    return g_hash_table_lookup(signald_input_type_table, type);
+}
+
+/*
+ * Writes the number of handled messages per type into the debug log.
+ */
+void
+signald_input_log_statistics(void)
+{
+    for (gsize i = 0; i < G_N_ELEMENTS(signald_input_types); i++) {
+        if (signald_input_types[i].count > 0) {
+            purple_debug_info(SIGNALD_PLUGIN_ID, "Handled %" G_GUINT64_FORMAT " messages of type %s.\n", signald_input_types[i].count, signald_input_types[i].type);
+        }
+    }
+    if (signald_input_unknown_count > 0) {
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Ignored %" G_GUINT64_FORMAT " messages of unknown type.\n", signald_input_unknown_count);
+    }
+}
+
+void
 signald_handle_input(SignaldAccount *sa, JsonNode *root)
 {
     JsonObject *obj = json_node_get_object(root);
     const gchar *type = json_object_get_string_member(obj, "type");
-    purple_debug_info(SIGNALD_PLUGIN_ID, "received type: %s\n", type);
+    if (purple_debug_is_verbose()) {
+        purple_debug_info(SIGNALD_PLUGIN_ID, "received type: %s\n", type);
+    }
 
     // catch and display errors
     JsonObject * error_object = NULL;
@@ -29,6 +272,12 @@ signald_handle_input(SignaldAccount *sa, JsonNode *root)
             error_object = json_object_get_object_member(obj, "error");
         }
     }
+
+    // responses to requests with a callback are handled by the callback
+    if (signald_handle_response(sa, obj, error_object != NULL)) {
+        return;
+    }
+
     if (error_object != NULL) {
         const char *error_type = json_object_get_string_member(obj, "error_type");
         const char *error_message = json_object_get_string_member(error_object, "message");
@@ -41,11 +290,13 @@ signald_handle_input(SignaldAccount *sa, JsonNode *root)
             signald_link_or_register(sa);
             return;
         } else if (strstr(error_message, "SQLITE_BUSY")) {
+            signald_flight_recorder_dump(sa->connection, "SQLite database busy.");
             purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "SQLite database busy.");
             return;
         } else {
             const char *message = json_object_get_string_member(error_object, "message");
             char *error_message = g_strdup_printf("%s occurred on %s: %s\n", error_type, type, message);
+            signald_flight_recorder_dump(sa->connection, error_message);
             purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR, error_message);
             g_free(error_message);
             return;
@@ -53,139 +304,12 @@ signald_handle_input(SignaldAccount *sa, JsonNode *root)
     }
 
     // no error, actions depending on type
-    if (purple_strequal(type, "version")) {
-        obj = json_object_get_object_member(obj, "data");
-        purple_debug_info(SIGNALD_PLUGIN_ID, "signald version: %s\n", json_object_get_string_member(obj, "version"));
-        signald_request_accounts(sa); // Request information on accounts, including our own UUID.
-
-    } else if (purple_strequal(type, "list_accounts")) {
-        JsonObject *data = json_object_get_object_member(obj, "data");
-        signald_parse_account_list(sa, json_object_get_array_member(data, "accounts"));
-
-    } else if (purple_strequal(type, "subscribe")) {
-        purple_debug_info(SIGNALD_PLUGIN_ID, "Subscribed!\n");
-        // request a sync from other devices
-        signald_request_sync(sa);
-
-    } else if (purple_strequal(type, "unsubscribe")) {
-        purple_connection_set_state(sa->pc, PURPLE_CONNECTION_DISCONNECTED);
-
-    } else if (purple_strequal(type, "request_sync")) {
-        // sync from other devices completed,
-        // now pull contacts and groups
-        signald_list_contacts(sa);
-        signald_request_group_list(sa);
-
-    } else if (purple_strequal(type, "list_contacts")) {
-        obj = json_object_get_object_member(obj, "data");
-        signald_parse_contact_list(sa, json_object_get_array_member(obj,"profiles"));
-
-    } else if (purple_strequal(type, "InternalError")) {
-        // TODO: find out which messages do have a "data" object and which do not
-        const char * message = json_object_get_string_member_or_null(obj, "message");
-        if (message == NULL) {
-            obj = json_object_get_object_member(obj, "data");
-            message = json_object_get_string_member_or_null(obj, "message");
-        }
-        if (purple_strequal(message, "org.whispersystems.signalservice.api.InvalidMessageStructureException: SyncMessage missing destination, group ID, and recipient manifest!")) {
-            // TODO: remove this special case after https://gitlab.com/signald/signald/-/issues/363 has been resolved
-            purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignoring InvalidMessageStructureException.\n");
-        } else if (purple_strequal(message, "org.signal.libsignal.metadata.InvalidMetadataMessageException: org.signal.libsignal.protocol.InvalidMessageException: invalid sealed sender message: derived ephemeral key did not match key provided in message")) {
-            // this means a message could not be fully processed and henceforth will not be displayed
-            // the connection should not be terminated, though
-            //purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignoring InvalidMetadataMessageException.\n");
-            const gchar * username = purple_account_get_username(sa->account);
-            PurpleConversation * conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, username, sa->account);
-            if (conv == NULL) {
-                conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, sa->account, username);
-            }
-            purple_conversation_write(conv, NULL, "InvalidMessageException happened in signald. Please check your primary device if you have one. The message is lost for this client. I am sorry.", PURPLE_MESSAGE_ERROR, time(NULL));
-        } else {
-            purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR, message);
-        }
-
-    } else if (purple_strequal(type, "get_profile")) {
-        obj = json_object_get_object_member(obj, "data");
-        signald_process_profile(sa, obj);
-
-    } else if (purple_strequal(type, "get_group")) {
-        obj = json_object_get_object_member(obj, "data");
-        signald_process_groupV2_obj(sa, obj);
-
-    } else if (purple_strequal(type, "list_groups")) {
-        obj = json_object_get_object_member(obj, "data");
-        signald_parse_groupV2_list(sa, json_object_get_array_member(obj, "groups"));
-
-    } else if (purple_strequal(type, "leave_group")) {
-        obj = json_object_get_object_member(obj, "data");
-        signald_process_leave_group(sa, obj);
-
-    } else if (purple_strequal(type, "IncomingMessage")) {
-        obj = json_object_get_object_member(obj, "data");
-        if (json_object_has_member(obj, "receipt_message")) {
-            signald_process_receipt(sa, obj);
-        } else if (json_object_has_member(obj, "typing_message")) {
-            signald_process_typing(sa, obj);
-        } else {
-            signald_process_message(sa, obj);
-        }
-
-    } else if (purple_strequal(type, "generate_linking_uri")) {
-        signald_parse_linking_uri(sa, obj);
-
-    } else if (purple_strequal (type, "finish_link")) {
-        signald_process_finish_link(sa, obj);
-
-    } else if (purple_strequal (type, "set_device_name")) {
-        purple_debug_info(SIGNALD_PLUGIN_ID, "Device name set successfully.\n");
-
-    } else if (purple_strequal(type, "send")) {
-        JsonObject *data = json_object_get_object_member(obj, "data");
-        signald_send_acknowledged(sa, data);
-        
-    } else if (purple_strequal(type, "mark_read")) {
-        // I do not really care if sending read receipts succeed.
-
-    } else if (purple_strequal(type, "WebSocketConnectionState")) {
-        JsonObject *data = json_object_get_object_member(obj, "data");
-        const gchar *state = json_object_get_string_member(data, "state");
-        if  (purple_strequal(state, "CONNECTED") && sa->uuid) {
-            purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTED);
-        } else if  (purple_strequal(state, "CONNECTING") && sa->uuid) {
-            purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTING);
-        } else if  (purple_strequal(state, "DISCONNECTED") && sa->uuid) {
-            // setting the connection state to DISCONNECTED invokes the destruction of the instance
-            // we probably do not want that (signald might already be doing a reconnect)
-            purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTING);
-            //purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "Disconnected.");
-        }
-        
-    } else if (purple_strequal(type, "ListenerState")) {
-        // obsolete variant of WebSocketConnectionState. ignore silently.
-        
-    } else if (purple_strequal(type, "ProtocolInvalidKeyIdError")) {
-        // this one has boolean "error": true
-        // TODO: get sender, show notification
-        
+    SignaldInputType *input_type = signald_input_type_lookup(type);
+    if (input_type != NULL) {
+        input_type->count++;
+        input_type->handler(sa, obj);
     } else {
+        signald_input_unknown_count++;
         purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignored message of unknown type '%s'.\n", type);
     }
 }
-
-void
-signald_parse_input(SignaldAccount *sa, const char * json, gssize length)
-{
-    JsonParser *parser = json_parser_new();
-    if (!json_parser_load_from_data(parser, json, length, NULL)) {
-        purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR, "Error parsing input.");
-        return;
-    } else {
-        JsonNode *root = json_parser_get_root(parser);
-        if (root == NULL) {
-            purple_connection_error(sa->pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR, "root node is NULL.");
-        } else {
-            signald_handle_input(sa, root);
-        }
-        g_object_unref(parser);
-    }
-}
@@ -2,4 +2,6 @@
 
 #include "structs.h"
 
-void signald_parse_input(SignaldAccount *sa, const char * json, gssize length);
+void signald_handle_input(SignaldAccount *sa, JsonNode *root);
+
+void signald_input_log_statistics(void);
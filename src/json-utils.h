@@ -9,3 +9,5 @@
     (json_object_has_member(JSON_OBJECT, MEMBER) ? json_object_get_string_member(JSON_OBJECT, MEMBER) : NULL)
 #define json_object_get_array_member_or_null(JSON_OBJECT, MEMBER) \
     (json_object_has_member(JSON_OBJECT, MEMBER) ? json_object_get_array_member(JSON_OBJECT, MEMBER) : NULL)
+#define json_object_get_int_member_or_zero(JSON_OBJECT, MEMBER) \
+    (json_object_has_member(JSON_OBJECT, MEMBER) ? json_object_get_int_member(JSON_OBJECT, MEMBER) : 0)
@@ -0,0 +1,236 @@
+#include <math.h> // for isfinite
+#include "json-writer.h"
+
+/*
+ * Serializes JSON trees straight into a GString.
+ *
+ * This avoids creating a JsonNode wrapper and a JsonGenerator for every request.
+ * The output is compact (no whitespace). Members appear in the order they have been added.
+ */
+
+typedef struct {
+    GString *out;
+    gsize limit; // writing stops once the output exceeds this length
+    gboolean redact; // whether string values are replaced by their length (except for the members in signald_json_unredacted)
+    const char *member; // name of the member being written, NULL for array elements
+} SignaldJsonWriter;
+
+#define SIGNALD_JSON_RAW_MEMBER_MAX 32 // longer keys are never in signald_json_unredacted
+
+// members which identify a frame rather than carry content
+static const char *signald_json_unredacted[] = {"type", "id", "account", "version", "error_type"};
+
+static void
+signald_json_write_node(SignaldJsonWriter *writer, JsonNode *node);
+
+/*
+ * Appends a string literal including the quotes. Characters which must be escaped in JSON are escaped.
+ * UTF-8 sequences are copied as they are.
+ */
+static void
+signald_json_write_string(GString *out, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    g_string_append_c(out, '"');
+    const char *run = s; // start of a sequence of characters which do not need escaping
+    for (const char *c = s; *c; c++) {
+        unsigned char u = *c;
+        if (u >= 0x20 && u != '"' && u != '\\') {
+            continue;
+        }
+        g_string_append_len(out, run, c - run);
+        run = c + 1;
+        switch (u) {
+            case '"': g_string_append(out, "\\\""); break;
+            case '\\': g_string_append(out, "\\\\"); break;
+            case '\b': g_string_append(out, "\\b"); break;
+            case '\f': g_string_append(out, "\\f"); break;
+            case '\n': g_string_append(out, "\\n"); break;
+            case '\r': g_string_append(out, "\\r"); break;
+            case '\t': g_string_append(out, "\\t"); break;
+            default: {
+                char escape[] = {'\\', 'u', '0', '0', hex[u >> 4], hex[u & 0xf]};
+                g_string_append_len(out, escape, sizeof escape);
+            }
+        }
+    }
+    g_string_append(out, run);
+    g_string_append_c(out, '"');
+}
+
+static gboolean
+signald_json_is_redacted(SignaldJsonWriter *writer)
+{
+    if (!writer->redact) {
+        return FALSE;
+    }
+    for (gsize i = 0; writer->member != NULL && i < G_N_ELEMENTS(signald_json_unredacted); i++) {
+        if (g_str_equal(writer->member, signald_json_unredacted[i])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void
+signald_json_write_value(SignaldJsonWriter *writer, JsonNode *node)
+{
+    GString *out = writer->out;
+    switch (json_node_get_value_type(node)) {
+        case G_TYPE_STRING:
+            if (signald_json_is_redacted(writer)) {
+                g_string_append_printf(out, "\"<%" G_GSIZE_FORMAT " bytes>\"", strlen(json_node_get_string(node)));
+            } else {
+                signald_json_write_string(out, json_node_get_string(node));
+            }
+            break;
+        case G_TYPE_INT64:
+        case G_TYPE_INT:
+            g_string_append_printf(out, "%" G_GINT64_FORMAT, json_node_get_int(node));
+            break;
+        case G_TYPE_BOOLEAN:
+            g_string_append(out, json_node_get_boolean(node) ? "true" : "false");
+            break;
+        case G_TYPE_DOUBLE:
+        case G_TYPE_FLOAT: {
+            double value = json_node_get_double(node);
+            if (isfinite(value)) {
+                char buffer[G_ASCII_DTOSTR_BUF_SIZE];
+                g_string_append(out, g_ascii_dtostr(buffer, sizeof buffer, value));
+            } else {
+                // JSON has no representation for NaN and infinity
+                g_string_append(out, "null");
+            }
+            break;
+        }
+        default:
+            g_string_append(out, "null");
+            break;
+    }
+}
+
+static void
+signald_json_write_member(JsonObject *obj, const gchar *name, JsonNode *node, gpointer data)
+{
+    SignaldJsonWriter *writer = data;
+    GString *out = writer->out;
+    if (out->len > writer->limit) {
+        return;
+    }
+    if (out->str[out->len - 1] != '{') {
+        g_string_append_c(out, ',');
+    }
+    signald_json_write_string(out, name);
+    g_string_append_c(out, ':');
+    writer->member = name;
+    signald_json_write_node(writer, node);
+}
+
+static void
+signald_json_write_element(JsonArray *array, guint index, JsonNode *node, gpointer data)
+{
+    SignaldJsonWriter *writer = data;
+    if (writer->out->len > writer->limit) {
+        return;
+    }
+    if (index > 0) {
+        g_string_append_c(writer->out, ',');
+    }
+    writer->member = NULL;
+    signald_json_write_node(writer, node);
+}
+
+static void
+signald_json_write_node(SignaldJsonWriter *writer, JsonNode *node)
+{
+    GString *out = writer->out;
+    switch (json_node_get_node_type(node)) {
+        case JSON_NODE_OBJECT:
+            g_string_append_c(out, '{');
+            json_object_foreach_member(json_node_get_object(node), signald_json_write_member, writer);
+            g_string_append_c(out, '}');
+            break;
+        case JSON_NODE_ARRAY:
+            g_string_append_c(out, '[');
+            json_array_foreach_element(json_node_get_array(node), signald_json_write_element, writer);
+            g_string_append_c(out, ']');
+            break;
+        case JSON_NODE_VALUE:
+            signald_json_write_value(writer, node);
+            break;
+        case JSON_NODE_NULL:
+            g_string_append(out, "null");
+            break;
+    }
+}
+
+/*
+ * Appends the serialized object to out.
+ */
+void
+signald_json_write_object(GString *out, JsonObject *obj)
+{
+    SignaldJsonWriter writer = {out, G_MAXSIZE, FALSE, NULL};
+    g_string_append_c(out, '{');
+    json_object_foreach_member(obj, signald_json_write_member, &writer);
+    g_string_append_c(out, '}');
+}
+
+/*
+ * Appends an excerpt of the serialized object to out for diagnostics.
+ * Members and elements are skipped once out exceeds limit bytes, so the excerpt is not necessarily valid JSON.
+ * With redact set, string values are replaced by their length except for those which identify the frame.
+ */
+void
+signald_json_write_excerpt(GString *out, JsonObject *obj, gsize limit, gboolean redact)
+{
+    SignaldJsonWriter writer = {out, limit, redact, NULL};
+    g_string_append_c(out, '{');
+    json_object_foreach_member(obj, signald_json_write_member, &writer);
+    g_string_append_c(out, '}');
+}
+
+/*
+ * Like signald_json_write_excerpt, but for a serialized frame which has not been parsed (or cannot be parsed).
+ * The frame is scanned lexically: Keys and everything outside of strings are copied as they are.
+ * With redact set, string values are replaced by their length except for those which identify the frame.
+ * Writing stops once out exceeds limit bytes.
+ */
+void
+signald_json_write_raw_excerpt(GString *out, const char *json, gsize length, gsize limit, gboolean redact)
+{
+    char member[SIGNALD_JSON_RAW_MEMBER_MAX] = ""; // most recent key
+    const char *end = json + length;
+    const char *c = json;
+    while (c < end && out->len <= limit) {
+        if (*c != '"') {
+            const char *run = c;
+            while (c < end && *c != '"') {
+                c++;
+            }
+            g_string_append_len(out, run, MIN(c - run, (gssize)(limit + 1 - out->len)));
+            continue;
+        }
+        const char *string = c++;
+        while (c < end && *c != '"') {
+            c += (*c == '\\' && c + 1 < end) ? 2 : 1;
+        }
+        c = MIN(c + 1, end); // after the closing quote
+        const char *next = c;
+        while (next < end && g_ascii_isspace(*next)) {
+            next++;
+        }
+        gboolean is_key = next < end && *next == ':';
+        if (is_key) {
+            gsize member_length = MIN((gsize)(c - string - 2), sizeof member - 1);
+            memcpy(member, string + 1, member_length);
+            member[member_length] = '\0';
+        }
+        SignaldJsonWriter writer = {out, limit, redact, member};
+        if (!is_key && signald_json_is_redacted(&writer)) {
+            g_string_append_printf(out, "\"<%" G_GSIZE_FORMAT " bytes>\"", (gsize)MAX(c - string - 2, 0));
+        } else {
+            g_string_append_len(out, string, c - string);
+        }
+    }
+}
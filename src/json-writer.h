@@ -0,0 +1,10 @@
+#pragma once
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+void signald_json_write_object(GString *out, JsonObject *obj);
+
+void signald_json_write_excerpt(GString *out, JsonObject *obj, gsize limit, gboolean redact);
+
+void signald_json_write_raw_excerpt(GString *out, const char *json, gsize length, gsize limit, gboolean redact);
@@ -0,0 +1,102 @@
+#include "latency.h"
+#include "purple_compat.h"
+#include "defines.h"
+#include "json-utils.h"
+
+/*
+ * Delivery latency of incoming messages, split into hops by the timestamps signald adds.
+ *
+ * The most recent SIGNALD_LATENCY_SAMPLES measurements are kept per hop and account.
+ * Percentiles are calculated from them on demand.
+ * Hops between devices depend on synchronized clocks. Skewed clocks show as implausible (possibly negative) values.
+ */
+
+#define SIGNALD_LATENCY_SAMPLES 1024
+
+struct SignaldLatency {
+    gint64 samples[SIGNALD_LATENCY_HOPS][SIGNALD_LATENCY_SAMPLES]; // in ms
+    guint count[SIGNALD_LATENCY_HOPS]; // number of measurements so far
+};
+
+static const char *signald_latency_hop_names[SIGNALD_LATENCY_HOPS] = {
+    "sender → server",
+    "server → signald",
+    "signald → display",
+    "plugin",
+};
+
+SignaldLatency *
+signald_latency_new(void)
+{
+    return g_new0(SignaldLatency, 1);
+}
+
+void
+signald_latency_free(SignaldLatency *latency)
+{
+    g_free(latency);
+}
+
+static void
+signald_latency_add(SignaldLatency *latency, SignaldLatencyHop hop, gint64 milliseconds)
+{
+    latency->samples[hop][latency->count[hop] % SIGNALD_LATENCY_SAMPLES] = milliseconds;
+    latency->count[hop]++;
+}
+
+/*
+ * Records the hops of an incoming message which has just been displayed.
+ * handling_start is the monotonic time at which the plugin started handling the message.
+ * Signal's timestamps are milliseconds since the epoch. Hops with missing timestamps are skipped.
+ */
+void
+signald_latency_record(SignaldAccount *sa, JsonObject *obj, gint64 handling_start)
+{
+    gint64 displayed = g_get_real_time() / 1000;
+    gint64 sent = json_object_get_int_member_or_zero(obj, "timestamp");
+    gint64 server_received = json_object_get_int_member_or_zero(obj, "server_receiver_timestamp");
+    gint64 server_delivered = json_object_get_int_member_or_zero(obj, "server_deliver_timestamp");
+    if (sent > 0 && server_received > 0) {
+        signald_latency_add(sa->latency, SIGNALD_LATENCY_SENDER_SERVER, server_received - sent);
+    }
+    if (server_received > 0 && server_delivered > 0) {
+        signald_latency_add(sa->latency, SIGNALD_LATENCY_SERVER_SIGNALD, server_delivered - server_received);
+    }
+    if (server_delivered > 0) {
+        signald_latency_add(sa->latency, SIGNALD_LATENCY_SIGNALD_DISPLAY, displayed - server_delivered);
+    }
+    signald_latency_add(sa->latency, SIGNALD_LATENCY_CLIENT, (g_get_monotonic_time() - handling_start) / 1000);
+}
+
+static gint
+signald_latency_compare(gconstpointer a, gconstpointer b)
+{
+    const gint64 x = *(const gint64 *)a;
+    const gint64 y = *(const gint64 *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Shows percentiles of all hops for the account.
+ */
+void
+signald_latency_action(PurpleConnection *pc)
+{
+    SignaldAccount *sa = purple_connection_get_protocol_data(pc);
+    GString *report = g_string_new("Delivery latency in ms of the most recent messages (count, p50, p90, p99, max):<br>");
+    for (int hop = 0; hop < SIGNALD_LATENCY_HOPS; hop++) {
+        guint length = MIN(sa->latency->count[hop], SIGNALD_LATENCY_SAMPLES);
+        g_string_append_printf(report, "%s: %u", signald_latency_hop_names[hop], length);
+        if (length > 0) {
+            gint64 sorted[SIGNALD_LATENCY_SAMPLES];
+            memcpy(sorted, sa->latency->samples[hop], length * sizeof *sorted);
+            qsort(sorted, length, sizeof *sorted, signald_latency_compare);
+            g_string_append_printf(report, ", %" G_GINT64_FORMAT ", %" G_GINT64_FORMAT ", %" G_GINT64_FORMAT ", %" G_GINT64_FORMAT,
+                sorted[(length - 1) * 50 / 100], sorted[(length - 1) * 90 / 100], sorted[(length - 1) * 99 / 100], sorted[length - 1]);
+        }
+        g_string_append(report, "<br>");
+    }
+    purple_debug_info(SIGNALD_PLUGIN_ID, "%s\n", report->str);
+    purple_notify_formatted(pc, SIGNALD_DIALOG_TITLE, "Delivery latency", purple_account_get_username(sa->account), report->str, NULL, NULL);
+    g_string_free(report, TRUE);
+}
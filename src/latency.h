@@ -0,0 +1,19 @@
+#pragma once
+
+#include "structs.h"
+
+typedef enum {
+    SIGNALD_LATENCY_SENDER_SERVER, // from sending until the server received the message
+    SIGNALD_LATENCY_SERVER_SIGNALD, // from the server receiving until it delivered the message to signald
+    SIGNALD_LATENCY_SIGNALD_DISPLAY, // from the server delivering until the message has been displayed
+    SIGNALD_LATENCY_CLIENT, // time spent on the message by the plugin (part of the previous hop)
+    SIGNALD_LATENCY_HOPS
+} SignaldLatencyHop;
+
+SignaldLatency * signald_latency_new(void);
+
+void signald_latency_free(SignaldLatency *latency);
+
+void signald_latency_record(SignaldAccount *sa, JsonObject *obj, gint64 handling_start);
+
+void signald_latency_action(PurpleConnection *pc);
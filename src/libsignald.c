@@ -33,6 +33,9 @@
 #include "interface.h"
 #include "status.h"
 #include "reply.h"
+#include "metrics.h"
+#include "latency.h"
+#include "flight-recorder.h"
 
 static void
 signald_update_contacts (PurplePluginAction* action)
@@ -52,6 +55,30 @@ signald_update_groups (PurplePluginAction* action)
   signald_request_group_list(sa);
 }
 
+static void
+signald_dump_metrics (PurplePluginAction* action)
+{
+  PurpleConnection* pc = action->context;
+
+  signald_metrics_action(pc);
+}
+
+static void
+signald_show_latency (PurplePluginAction* action)
+{
+  PurpleConnection* pc = action->context;
+
+  signald_latency_action(pc);
+}
+
+static void
+signald_show_flight_recorder (PurplePluginAction* action)
+{
+  PurpleConnection* pc = action->context;
+
+  signald_flight_recorder_action(pc);
+}
+
 static GList *
 signald_actions(PurplePlugin *plugin, gpointer context)
 {
@@ -64,6 +91,18 @@ signald_actions(PurplePlugin *plugin, gpointer context)
         PurplePluginAction *act = purple_plugin_action_new("Update Groups", &signald_update_groups);
         acts = g_list_append(acts, act);
     }
+    {
+        PurplePluginAction *act = purple_plugin_action_new("Dump Metrics", &signald_dump_metrics);
+        acts = g_list_append(acts, act);
+    }
+    {
+        PurplePluginAction *act = purple_plugin_action_new("Show Delivery Latency", &signald_show_latency);
+        acts = g_list_append(acts, act);
+    }
+    {
+        PurplePluginAction *act = purple_plugin_action_new("Show Flight Recorder", &signald_show_flight_recorder);
+        acts = g_list_append(acts, act);
+    }
     return acts;
 }
 
@@ -3,6 +3,7 @@
 #include <purple.h>
 #include "structs.h"
 
+SignaldAccount * signald_login_prepare(PurpleAccount *account);
 void signald_login(PurpleAccount *account);
 void signald_subscribe(SignaldAccount *sa);
 void signald_close(PurpleConnection *pc);
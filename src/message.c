@@ -11,6 +11,10 @@
 #include "reply.h"
 #include "groups.h"
 #include "json-utils.h"
+#include "metrics.h"
+#include "trace.h"
+#include "latency.h"
+#include "msglog.h"
 
 const char *
 signald_get_uuid_from_address(JsonObject *obj, const char *address_key)
@@ -56,7 +60,7 @@ signald_set_recipient(JsonObject *obj, const gchar *key, const gchar *recipient)
 }
 
 gboolean
-signald_format_message(SignaldAccount *sa, JsonObject *data, GString **target, gboolean *has_attachment)
+signald_format_message(SignaldAccount *sa, const char *conversation, JsonObject *data, GString **target, gboolean *has_attachment)
 {
     // handle attachments, creating appropriate message content (always allocates *target)
     *target = signald_prepare_attachments_message(sa, data);
@@ -95,13 +99,18 @@ signald_format_message(SignaldAccount *sa, JsonObject *data, GString **target, g
         JsonObject *reaction = json_object_get_object_member(data, "reaction");
         const char *emoji = json_object_get_string_member(reaction, "emoji");
         const gboolean remove = json_object_get_boolean_member(reaction, "remove");
-        const time_t targetSentTimestamp = json_object_get_int_member(reaction, "targetSentTimestamp") / 1000;
+        const gint64 target_timestamp = json_object_get_int_member(reaction, "targetSentTimestamp");
+        const time_t targetSentTimestamp = target_timestamp / 1000;
         struct tm *tm = localtime(&targetSentTimestamp);
+        gchar *excerpt = signald_msglog_excerpt(sa->msglog, conversation, target_timestamp);
         if (remove) {
             g_string_printf(*target, "removed their %s reaction.", emoji);
+        } else if (excerpt) {
+            g_string_printf(*target, "reacted with %s to \"%s\" (message from %s).", emoji, excerpt, purple_date_format_long(tm));
         } else {
             g_string_printf(*target, "reacted with %s (to message from %s).", emoji, purple_date_format_long(tm));
         }
+        g_free(excerpt);
     }
     
     if (json_object_has_member(data, "groupV2")) {
@@ -164,6 +173,7 @@ signald_process_message(SignaldAccount *sa, JsonObject *obj)
     // server_receiver_timestamp is when the server received the message
     // server_deliver_timestamp is when the server delivered the message
     gint64 timestamp = json_object_get_int_member(obj, "timestamp");
+    gint64 handling_start = g_get_monotonic_time();
 
     const gchar * sender_uuid = NULL;
     JsonObject *message_data = NULL;
@@ -184,6 +194,10 @@ signald_process_message(SignaldAccount *sa, JsonObject *obj)
                 sender_uuid = signald_get_uuid_from_address(sent, "destination");
             }
             message_data = json_object_get_object_member(sent, "message");
+        } else if (json_object_has_member(sync_message, "read_messages")) {
+            // messages have been read on another device
+            signald_process_read_sync(sa, json_object_get_array_member(sync_message, "read_messages"));
+            return;
         }
     } else if (json_object_has_member(obj, "data_message")) {
         message_data = json_object_get_object_member(obj, "data_message");
@@ -198,6 +212,7 @@ signald_process_message(SignaldAccount *sa, JsonObject *obj)
             groupId = json_object_get_string_member(groupInfo, "id");
         }
         signald_display_message(sa, sender_uuid, groupId, timestamp, sent != NULL, message_data);
+        signald_latency_record(sa, obj, handling_start);
     }
 }
 
@@ -220,6 +235,45 @@ signald_process_typing(SignaldAccount *sa, JsonObject *obj)
     }
 }
 
+/*
+ * An outgoing message waiting for signald's acknowledgement.
+ */
+typedef struct {
+    gchar *who; // recipient (a group ID in case of group chats)
+    gchar *message; // message for local echo. NULL if purple echoes the message itself.
+    gchar *body; // message as sent for the message log and receipts. NULL if neither is enabled.
+} SignaldOutgoingMessage;
+
+static void
+signald_outgoing_message_free(SignaldOutgoingMessage *outgoing)
+{
+    g_free(outgoing->who);
+    g_free(outgoing->message);
+    g_free(outgoing->body);
+    g_free(outgoing);
+}
+
+/*
+ * Finds the conversation an outgoing message belongs to.
+ * This is done when the acknowledgement arrives since the user may have closed the conversation in the meantime.
+ */
+static PurpleConversation *
+signald_outgoing_message_conversation(SignaldAccount *sa, SignaldOutgoingMessage *outgoing)
+{
+    PurpleConversation *conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_ANY, outgoing->who, sa->account);
+    if (conv == NULL) {
+        // no appropriate conversation was found. maybe it is a group?
+        PurpleConvChat *conv_chat = purple_conversations_find_chat_with_account(outgoing->who, sa->account);
+        if (conv_chat != NULL) {
+            conv = conv_chat->conv;
+        }
+    }
+    return conv;
+}
+
+static void
+signald_send_acknowledged(SignaldAccount *sa, JsonObject *response, gpointer user_data);
+
 int
 signald_send_message(SignaldAccount *sa, const gchar *who, gboolean is_chat, const char *message)
 {
@@ -234,9 +288,9 @@ signald_send_message(SignaldAccount *sa, const gchar *who, gboolean is_chat, con
         signald_set_recipient(data, "recipientAddress", who);
     }
 
-    SignaldMessage *reply_message = signald_replycache_check(sa, message);
-    if (reply_message != NULL) {
-        signald_replycache_apply(data, reply_message);
+    SignaldMessage reply_message;
+    if (signald_replycache_check(sa, who, message, &reply_message)) {
+        signald_replycache_apply(data, &reply_message);
         message = signald_replycache_strip_needle(message);
     }
     JsonArray *attachments = json_array_new();
@@ -247,29 +301,21 @@ signald_send_message(SignaldAccount *sa, const gchar *who, gboolean is_chat, con
     json_object_set_string_member(data, "messageBody", plain);
 
     int ret = !purple_account_get_bool(sa->account, SIGNALD_OPTION_WAIT_SEND_ACKNOWLEDEMENT, FALSE);
-    if (!signald_send_json(sa, data)) {
-        ret = -errno;
-    }
-    json_object_unref(data);
-
-    // wait for signald to acknowledge the message has been sent
-    // for displaying the outgoing message later, it is stored locally
+    SignaldOutgoingMessage *outgoing = g_new0(SignaldOutgoingMessage, 1);
+    outgoing->who = g_strdup(who);
     if (ret == 0) {
-        // free last message just in case it still lingers in memory
-        g_free(sa->last_message);
-        // store message for later echo
+        // wait for signald to acknowledge the message has been sent
+        // for displaying the outgoing message later, it is stored along with the request
         // NOTE: this stores the message "as sent" (without markup, without images)
-        sa->last_message = g_strdup(plain);
-        // store this as the currently active conversation
-        sa->last_conversation = purple_find_conversation_with_account(PURPLE_CONV_TYPE_ANY, who, sa->account);
-        if (sa->last_conversation == NULL) {
-            // no appropriate conversation was found. maybe it is a group?
-            PurpleConvChat *conv_chat = purple_conversations_find_chat_with_account(who, sa->account);
-            if (conv_chat != NULL) {
-                sa->last_conversation = conv_chat->conv;
-            }
-        }
+        outgoing->message = g_strdup(plain);
     }
+    if (sa->msglog || purple_account_get_bool(sa->account, SIGNALD_OPTION_DISPLAY_RECEIPTS, FALSE)) {
+        outgoing->body = g_strdup(plain);
+    }
+    if (!signald_send_request(sa, data, signald_send_acknowledged, outgoing, (GDestroyNotify)signald_outgoing_message_free)) {
+        ret = -errno;
+    }
+    json_object_unref(data);
     
     g_free(plain);
     return ret;
@@ -277,6 +323,7 @@ signald_send_message(SignaldAccount *sa, const gchar *who, gboolean is_chat, con
 
 struct SignaldSendResult {
   SignaldAccount *sa;
+  PurpleConversation *conv;
   int devices_count;
 };
 
@@ -304,20 +351,45 @@ signald_send_check_result(JsonArray* results, guint i, JsonNode* result_node, gp
         failure = "unregisteredFailure";
     }
     if (failure) {
+        signald_metrics_delivery_failure(failure);
         JsonObject * address = json_object_get_object_member(result, "address");
         const gchar * number = json_object_get_string_member(address, "number");
         const gchar * uuid = json_object_get_string_member(address, "uuid");
         gchar * errmsg = g_strdup_printf("Message was not delivered to %s (%s) due to %s.", number, uuid, failure);
-        purple_conversation_write(sr->sa->last_conversation, NULL, errmsg, PURPLE_MESSAGE_ERROR, time(NULL));
+        if (sr->conv) {
+            purple_conversation_write(sr->conv, NULL, errmsg, PURPLE_MESSAGE_ERROR, time(NULL));
+        } else {
+            purple_debug_error(SIGNALD_PLUGIN_ID, "%s\n", errmsg);
+        }
         g_free(errmsg);
     }
 }
 
-void
-signald_send_acknowledged(SignaldAccount *sa,  JsonObject *data) {
+/*
+ * Handles signald's response to a send request.
+ */
+static void
+signald_send_acknowledged(SignaldAccount *sa, JsonObject *response, gpointer user_data) {
+    SignaldOutgoingMessage *outgoing = user_data;
     struct SignaldSendResult sr;
     sr.sa = sa;
+    sr.conv = signald_outgoing_message_conversation(sa, outgoing);
     sr.devices_count = 0;
+    if (response == NULL) {
+        signald_metrics_increment(SIGNALD_METRIC_SEND_TIMEOUTS);
+        const char *errmsg = "signald did not acknowledge the message in time. It may or may not have been delivered.";
+        if (sr.conv) {
+            purple_conversation_write(sr.conv, NULL, errmsg, PURPLE_MESSAGE_ERROR, time(NULL));
+        } else {
+            purple_debug_error(SIGNALD_PLUGIN_ID, "%s\n", errmsg);
+        }
+        return;
+    }
+    signald_metrics_increment(SIGNALD_METRIC_SEND_ACKNOWLEDGED);
+    JsonObject *data = json_object_get_object_member(response, "data");
+    if (outgoing->body && sa->msglog) {
+        signald_msglog_append(sa->msglog, outgoing->who, json_object_get_int_member(data, "timestamp"), sa->uuid, outgoing->body, TRUE);
+    }
     JsonArray * results = json_object_get_array_member(data, "results");
     if (results) {
         if (json_array_get_length(results) == 0) {
@@ -328,17 +400,18 @@ signald_send_acknowledged(SignaldAccount *sa,  JsonObject *data) {
             json_array_foreach_element(results, signald_send_check_result, &sr);
         }
     }
-    if (sa->last_conversation && sa->uuid && sa->last_message) {
+    if (sr.devices_count > 0) {
+        signald_sent_messages_add(sa, outgoing->who, json_object_get_int_member(data, "timestamp"), outgoing->body);
+    }
+    if (sr.conv && sa->uuid && outgoing->message) {
         if (sr.devices_count > 0) {
             const guint64 timestamp_micro = json_object_get_int_member(data, "timestamp");
             PurpleMessageFlags flags = PURPLE_MESSAGE_SEND | PURPLE_MESSAGE_REMOTE_SEND | PURPLE_MESSAGE_DELAYED;
-            purple_conversation_write(sa->last_conversation, sa->uuid, sa->last_message, flags, timestamp_micro / 1000);
-            signald_replycache_add_message(sa, sa->last_conversation, sa->uuid, timestamp_micro, sa->last_message);
-            g_free(sa->last_message);
-            sa->last_message = NULL;
+            purple_conversation_write(sr.conv, sa->uuid, outgoing->message, flags, timestamp_micro / 1000);
+            signald_replycache_add_message(sa, sr.conv, sa->uuid, timestamp_micro, outgoing->message);
         } else {
             // form purple_conv_present_error()
-            purple_conversation_write(sa->last_conversation, NULL, "Message was not delivered to any devices.", PURPLE_MESSAGE_ERROR, time(NULL));
+            purple_conversation_write(sr.conv, NULL, "Message was not delivered to any devices.", PURPLE_MESSAGE_ERROR, time(NULL));
         }
     } else if (sr.devices_count == 0) {
         purple_debug_error(SIGNALD_PLUGIN_ID, "A message was not delivered to any devices.\n");
@@ -353,7 +426,11 @@ signald_display_message(SignaldAccount *sa, const char *who, const char *groupId
     PurpleMessageFlags flags = 0;
     GString *content = NULL;
     gboolean has_attachment = FALSE;
-    if (signald_format_message(sa, message_data, &content, &has_attachment)) {
+    gint64 start = signald_trace_begin();
+    const char *conversation = groupId ? groupId : who;
+    gboolean formatted = signald_format_message(sa, conversation, message_data, &content, &has_attachment);
+    signald_trace_end("signald_format_message", NULL, start);
+    if (formatted) {
         if (has_attachment) {
             flags |= PURPLE_MESSAGE_IMAGES;
         }
@@ -365,14 +442,22 @@ signald_display_message(SignaldAccount *sa, const char *who, const char *groupId
         PurpleConversation * conv = NULL;
         if (groupId) {
             conv = signald_enter_group_chat(sa->pc, groupId, NULL);
+            start = signald_trace_begin();
             purple_conv_chat_write(PURPLE_CONV_CHAT(conv), who, content->str, flags, timestamp_milli);
+            signald_trace_end("purple_conv_chat_write", NULL, start);
             // TODO: use serv_got_chat_in for more traditonal behaviour
             // though it compares who against chat->nick and sets the SEND/RECV flags itself
-            signald_mark_read_chat(sa, timestamp_micro, PURPLE_CONV_CHAT(conv)->users);
+            if (!is_sync_message) {
+                // only the author needs to know, receipts for the same author are batched across groups
+                signald_metrics_add(SIGNALD_METRIC_GROUP_RECEIPT_MEMBERS, g_hash_table_size(PURPLE_CONV_CHAT(conv)->users));
+                signald_mark_read(sa, timestamp_micro, who, groupId);
+            }
         } else {
             if (flags & PURPLE_MESSAGE_RECV) {
                 // incoming message
+                start = signald_trace_begin();
                 purple_serv_got_im(sa->pc, who, content->str, flags, timestamp_milli);
+                signald_trace_end("purple_serv_got_im", NULL, start);
                 // although purple_serv_got_im did most of the work, we still need to fill conv for populating the message cache
                 conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, who, sa->account);
             } else {
@@ -381,11 +466,20 @@ signald_display_message(SignaldAccount *sa, const char *who, const char *groupId
                 if (conv == NULL) {
                     conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, sa->account, who);
                 }
+                start = signald_trace_begin();
                 purple_conv_im_write(PURPLE_CONV_IM(conv), who, content->str, flags, timestamp_milli);
+                signald_trace_end("purple_conv_im_write", NULL, start);
+            }
+            if (!is_sync_message) {
+                // we do not send receipts for our own messages
+                signald_mark_read(sa, timestamp_micro, who, who);
             }
-            signald_mark_read(sa, timestamp_micro, who);
         }
         signald_replycache_add_message(sa, conv, who, timestamp_micro, json_object_get_string_member_or_null(message_data, "body"));
+        signald_msglog_append(sa->msglog, conversation, timestamp_micro, is_sync_message ? sa->uuid : who, json_object_get_string_member_or_null(message_data, "body"), is_sync_message);
+        if (is_sync_message) {
+            signald_sent_messages_add(sa, conversation, timestamp_micro, json_object_get_string_member_or_null(message_data, "body"));
+        }
     } else {
         purple_debug_warning(SIGNALD_PLUGIN_ID, "signald_format_message returned false.\n");
     }
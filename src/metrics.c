@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+#include "purple_compat.h"
+#include "defines.h"
+#include "reply.h"
+
+/*
+ * Protocol metrics in Prometheus text format.
+ *
+ * Counted are frames and bytes received per type including a histogram of the handling time,
+ * requests and bytes sent per type, send acknowledgements, delivery failures per reason and connection events.
+ * The metrics are process-wide (shared by all accounts).
+ *
+ * They can be exported periodically to a file or served on a unix socket (one response per connection),
+ * configured by the account which opens the connection to signald. A plugin action dumps them into the debug log.
+ */
+
+static const gint64 signald_metrics_buckets[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000}; // in µs
+
+typedef struct {
+    guint64 frames;
+    guint64 bytes;
+    guint64 buckets[G_N_ELEMENTS(signald_metrics_buckets)]; // non-cumulative, the last (+Inf) bucket is frames
+    gint64 duration_sum; // in µs
+    guint64 requests;
+    guint64 request_bytes;
+} SignaldMetricsType;
+
+static const char *signald_metrics_names[SIGNALD_METRIC_COUNT][2] = {
+    {"signald_send_acknowledged_total", "Send requests signald has responded to."},
+    {"signald_send_timeouts_total", "Send requests signald did not respond to in time."},
+    {"signald_connects_total", "Connections established to signald."},
+    {"signald_connection_errors_total", "Connections to signald lost or failed."},
+    {"signald_receipts_sent_total", "Timestamps sent in read receipts."},
+    {"signald_receipt_requests_total", "Requests read receipts were sent in."},
+    {"signald_receipt_duplicates_total", "Timestamps marked as read again while a receipt was pending."},
+    {"signald_group_receipt_members_total", "Receipts a per-member fan-out would have queued for group messages (only the author receives one)."},
+    {"signald_receipts_suppressed_total", "Receipts not sent because the message had been read on another device."},
+};
+
+static guint64 signald_metrics_counters[SIGNALD_METRIC_COUNT] = {0};
+static GHashTable *signald_metrics_types = NULL; // type → SignaldMetricsType
+static GHashTable *signald_metrics_failures = NULL; // reason → count (as pointer)
+
+void
+signald_metrics_increment(SignaldMetric metric)
+{
+    signald_metrics_counters[metric]++;
+}
+
+void
+signald_metrics_add(SignaldMetric metric, guint64 value)
+{
+    signald_metrics_counters[metric] += value;
+}
+
+void
+signald_metrics_delivery_failure(const char *reason)
+{
+    if (signald_metrics_failures == NULL) {
+        signald_metrics_failures = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    gpointer key = NULL;
+    gpointer count = NULL;
+    if (g_hash_table_lookup_extended(signald_metrics_failures, reason, &key, &count)) {
+        g_hash_table_insert(signald_metrics_failures, key, GSIZE_TO_POINTER(GPOINTER_TO_SIZE(count) + 1));
+    } else {
+        g_hash_table_insert(signald_metrics_failures, g_strdup(reason), GSIZE_TO_POINTER(1));
+    }
+}
+
+static SignaldMetricsType *
+signald_metrics_type(const char *type)
+{
+    if (type == NULL) {
+        type = "";
+    }
+    if (signald_metrics_types == NULL) {
+        signald_metrics_types = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    SignaldMetricsType *metrics = g_hash_table_lookup(signald_metrics_types, type);
+    if (metrics == NULL) {
+        metrics = g_new0(SignaldMetricsType, 1);
+        g_hash_table_insert(signald_metrics_types, g_strdup(type), metrics);
+    }
+    return metrics;
+}
+
+/*
+ * Counts a frame of the given type which has been handled within duration µs.
+ */
+void
+signald_metrics_frame_handled(const char *type, gsize bytes, gint64 duration)
+{
+    SignaldMetricsType *metrics = signald_metrics_type(type);
+    metrics->frames++;
+    metrics->bytes += bytes;
+    metrics->duration_sum += duration;
+    for (gsize i = 0; i < G_N_ELEMENTS(signald_metrics_buckets); i++) {
+        if (duration <= signald_metrics_buckets[i]) {
+            metrics->buckets[i]++;
+            break;
+        }
+    }
+}
+
+void
+signald_metrics_request_sent(const char *type, gsize bytes)
+{
+    SignaldMetricsType *metrics = signald_metrics_type(type);
+    metrics->requests++;
+    metrics->request_bytes += bytes;
+}
+
+/*
+ * Appends a label value, escaped according to the text exposition format.
+ */
+static void
+signald_metrics_append_label(GString *out, const char *value)
+{
+    for (const char *c = value; *c; c++) {
+        switch (*c) {
+            case '\\': g_string_append(out, "\\\\"); break;
+            case '"': g_string_append(out, "\\\""); break;
+            case '\n': g_string_append(out, "\\n"); break;
+            default: g_string_append_c(out, *c);
+        }
+    }
+}
+
+static void
+signald_metrics_append_typed(GString *out, const char *name, const char *type, guint64 value)
+{
+    g_string_append_printf(out, "%s{type=\"", name);
+    signald_metrics_append_label(out, type);
+    g_string_append_printf(out, "\"} %" G_GUINT64_FORMAT "\n", value);
+}
+
+/*
+ * Appends the memory used by the reply caches of all accounts.
+ */
+static void
+signald_metrics_append_reply_caches(GString *out)
+{
+    const char *families[][2] = {
+        {"signald_reply_cache_messages", "Messages in the reply cache."},
+        {"signald_reply_cache_bytes", "Bytes occupied by messages in the reply cache."},
+        {"signald_reply_cache_arena_bytes", "Size of the reply cache."},
+        {"signald_reply_cache_index_bytes", "Bytes occupied by the reply cache's index."},
+    };
+    for (gsize f = 0; f < G_N_ELEMENTS(families); f++) {
+        g_string_append_printf(out, "# HELP %s %s\n# TYPE %s gauge\n", families[f][0], families[f][1], families[f][0]);
+        for (GList *iter = purple_connections_get_all(); iter != NULL; iter = iter->next) {
+            PurpleConnection *pc = iter->data;
+            PurpleAccount *account = purple_connection_get_account(pc);
+            SignaldAccount *sa = purple_connection_get_protocol_data(pc);
+            if (!purple_strequal(purple_account_get_protocol_id(account), SIGNALD_PLUGIN_ID) || sa == NULL || sa->replycache == NULL) {
+                continue;
+            }
+            guint messages = 0;
+            gsize used = 0, arena = 0, index = 0;
+            signald_replycache_get_statistics(sa->replycache, &messages, &used, &arena, &index);
+            guint64 values[] = {messages, used, arena, index};
+            g_string_append_printf(out, "%s{account=\"", families[f][0]);
+            signald_metrics_append_label(out, purple_account_get_username(account));
+            g_string_append_printf(out, "\"} %" G_GUINT64_FORMAT "\n", values[f]);
+        }
+    }
+}
+
+/*
+ * Returns all metrics in Prometheus text format.
+ */
+gchar *
+signald_metrics_format(void)
+{
+    GString *out = g_string_new(NULL);
+    for (int m = 0; m < SIGNALD_METRIC_COUNT; m++) {
+        g_string_append_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %" G_GUINT64_FORMAT "\n",
+            signald_metrics_names[m][0], signald_metrics_names[m][1], signald_metrics_names[m][0], signald_metrics_names[m][0], signald_metrics_counters[m]);
+    }
+
+    g_string_append(out, "# HELP signald_delivery_failures_total Recipients a message could not be delivered to.\n# TYPE signald_delivery_failures_total counter\n");
+    if (signald_metrics_failures) {
+        GHashTableIter iter;
+        gpointer reason, count;
+        g_hash_table_iter_init(&iter, signald_metrics_failures);
+        while (g_hash_table_iter_next(&iter, &reason, &count)) {
+            g_string_append(out, "signald_delivery_failures_total{reason=\"");
+            signald_metrics_append_label(out, reason);
+            g_string_append_printf(out, "\"} %" G_GSIZE_FORMAT "\n", GPOINTER_TO_SIZE(count));
+        }
+    }
+
+    if (signald_metrics_types) {
+        GList *types = g_list_sort(g_hash_table_get_keys(signald_metrics_types), (GCompareFunc)g_strcmp0);
+        const char *families[][3] = {
+            {"signald_frames_received_total", "Frames received from signald.", "counter"},
+            {"signald_bytes_received_total", "Bytes of frames received from signald.", "counter"},
+            {"signald_requests_sent_total", "Requests sent to signald.", "counter"},
+            {"signald_bytes_sent_total", "Bytes of requests sent to signald.", "counter"},
+        };
+        for (gsize f = 0; f < G_N_ELEMENTS(families); f++) {
+            g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", families[f][0], families[f][1], families[f][0], families[f][2]);
+            for (GList *iter = types; iter != NULL; iter = iter->next) {
+                SignaldMetricsType *metrics = g_hash_table_lookup(signald_metrics_types, iter->data);
+                guint64 values[] = {metrics->frames, metrics->bytes, metrics->requests, metrics->request_bytes};
+                if (f < 2 ? metrics->frames > 0 : metrics->requests > 0) {
+                    signald_metrics_append_typed(out, families[f][0], iter->data, values[f]);
+                }
+            }
+        }
+
+        g_string_append(out, "# HELP signald_handler_duration_seconds Time spent on handling a frame.\n# TYPE signald_handler_duration_seconds histogram\n");
+        for (GList *iter = types; iter != NULL; iter = iter->next) {
+            SignaldMetricsType *metrics = g_hash_table_lookup(signald_metrics_types, iter->data);
+            if (metrics->frames == 0) {
+                continue;
+            }
+            guint64 cumulative = 0;
+            for (gsize i = 0; i <= G_N_ELEMENTS(signald_metrics_buckets); i++) {
+                g_string_append(out, "signald_handler_duration_seconds_bucket{type=\"");
+                signald_metrics_append_label(out, iter->data);
+                if (i < G_N_ELEMENTS(signald_metrics_buckets)) {
+                    cumulative += metrics->buckets[i];
+                    g_string_append_printf(out, "\",le=\"%g\"} %" G_GUINT64_FORMAT "\n", signald_metrics_buckets[i] / 1e6, cumulative);
+                } else {
+                    g_string_append_printf(out, "\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n", metrics->frames);
+                }
+            }
+            g_string_append(out, "signald_handler_duration_seconds_sum{type=\"");
+            signald_metrics_append_label(out, iter->data);
+            g_string_append_printf(out, "\"} %g\n", metrics->duration_sum / 1e6);
+            signald_metrics_append_typed(out, "signald_handler_duration_seconds_count", iter->data, metrics->frames);
+        }
+        g_list_free(types);
+    }
+    signald_metrics_append_reply_caches(out);
+    return g_string_free(out, FALSE);
+}
+
+static gboolean
+signald_metrics_write_file_cb(gpointer data)
+{
+    SignaldConnection *conn = data;
+    gchar *metrics = signald_metrics_format();
+    GError *error = NULL;
+    // written atomically, so readers never see partial content
+    if (!g_file_set_contents(conn->metrics_file, metrics, -1, &error)) {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Cannot write metrics: %s\n", error->message);
+        g_error_free(error);
+    }
+    g_free(metrics);
+    return TRUE;
+}
+
+static void
+signald_metrics_accept_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+    int client = accept(source, NULL, NULL);
+    if (client < 0) {
+        return;
+    }
+    // the response is small, so it is written in one go
+    gchar *metrics = signald_metrics_format();
+    if (send(client, metrics, strlen(metrics), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Cannot send metrics: %s\n", strerror(errno));
+    }
+    g_free(metrics);
+    close(client);
+}
+
+/*
+ * Starts exporting as configured in the account's options.
+ */
+void
+signald_metrics_exporter_start(SignaldConnection *conn, PurpleAccount *account)
+{
+    conn->metrics_listener = -1;
+    const char *file = purple_account_get_string(account, SIGNALD_OPTION_METRICS_FILE, "");
+    if (file && file[0]) {
+        conn->metrics_file = g_strdup(file);
+        conn->metrics_timer = purple_timeout_add_seconds(SIGNALD_METRICS_INTERVAL_SECONDS, signald_metrics_write_file_cb, conn);
+    }
+    const char *socket_path = purple_account_get_string(account, SIGNALD_OPTION_METRICS_SOCKET, "");
+    if (socket_path && socket_path[0]) {
+        struct sockaddr_un address = {.sun_family = AF_UNIX};
+        if (strlen(socket_path) >= sizeof address.sun_path) {
+            purple_debug_error(SIGNALD_PLUGIN_ID, "Metrics socket path %s is too long.\n", socket_path);
+            return;
+        }
+        strcpy(address.sun_path, socket_path);
+        unlink(socket_path); // remove stale socket
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof address) != 0 || listen(fd, 4) != 0) {
+            purple_debug_error(SIGNALD_PLUGIN_ID, "Cannot serve metrics on %s: %s\n", socket_path, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        conn->metrics_listener = fd;
+        conn->metrics_socket = g_strdup(socket_path);
+        conn->metrics_watcher = purple_input_add(fd, PURPLE_INPUT_READ, signald_metrics_accept_cb, conn);
+    }
+}
+
+void
+signald_metrics_exporter_stop(SignaldConnection *conn)
+{
+    if (conn->metrics_timer) {
+        purple_timeout_remove(conn->metrics_timer);
+        conn->metrics_timer = 0;
+        signald_metrics_write_file_cb(conn); // final state
+    }
+    g_free(conn->metrics_file);
+    conn->metrics_file = NULL;
+    if (conn->metrics_watcher) {
+        purple_input_remove(conn->metrics_watcher);
+        conn->metrics_watcher = 0;
+    }
+    if (conn->metrics_listener >= 0) {
+        close(conn->metrics_listener);
+        conn->metrics_listener = -1;
+        unlink(conn->metrics_socket);
+    }
+    g_free(conn->metrics_socket);
+    conn->metrics_socket = NULL;
+}
+
+/*
+ * Dumps the metrics into the debug log.
+ */
+void
+signald_metrics_action(PurpleConnection *pc)
+{
+    gchar *metrics = signald_metrics_format();
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Metrics:\n%s", metrics);
+    g_free(metrics);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "structs.h"
+
+typedef enum {
+    SIGNALD_METRIC_SEND_ACKNOWLEDGED, // send requests signald has responded to
+    SIGNALD_METRIC_SEND_TIMEOUTS, // send requests signald did not respond to in time
+    SIGNALD_METRIC_CONNECTS, // connections established to signald
+    SIGNALD_METRIC_CONNECTION_ERRORS, // connections lost or failed
+    SIGNALD_METRIC_RECEIPTS_SENT, // timestamps sent in read receipts
+    SIGNALD_METRIC_RECEIPT_REQUESTS, // requests read receipts were sent in
+    SIGNALD_METRIC_RECEIPT_DUPLICATES, // timestamps marked as read again while pending
+    SIGNALD_METRIC_GROUP_RECEIPT_MEMBERS, // group members receipts would have been sent to before targeting the author only
+    SIGNALD_METRIC_RECEIPTS_SUPPRESSED, // receipts not sent since the message was read on another device
+    SIGNALD_METRIC_COUNT
+} SignaldMetric;
+
+void signald_metrics_increment(SignaldMetric metric);
+
+void signald_metrics_add(SignaldMetric metric, guint64 value);
+
+void signald_metrics_delivery_failure(const char *reason);
+
+void signald_metrics_frame_handled(const char *type, gsize bytes, gint64 duration);
+
+void signald_metrics_request_sent(const char *type, gsize bytes);
+
+gchar * signald_metrics_format(void);
+
+void signald_metrics_exporter_start(SignaldConnection *conn, PurpleAccount *account);
+
+void signald_metrics_exporter_stop(SignaldConnection *conn);
+
+void signald_metrics_action(PurpleConnection *pc);
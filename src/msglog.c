@@ -0,0 +1,463 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "msglog.h"
+#include "purple_compat.h"
+#include "defines.h"
+
+/*
+ * Persistent log of recent messages per account, so replies, reactions and receipts can be resolved after a restart.
+ *
+ * The log is a file of fixed size in purple's user directory which is memory-mapped.
+ * Records are appended. Once the file is full, the older half of the records is dropped.
+ * Every record holds the conversation (buddy or group id), timestamp, author and text of a message.
+ *
+ * Records are looked up by (conversation, timestamp) in a sorted index in O(log n).
+ * The index is saved next to the log when the account disconnects. On the next start, it is loaded
+ * and only records appended after it was saved (e.g. in case of a crash) need to be scanned.
+ */
+
+#define SIGNALD_MSGLOG_MAGIC "SGDMLOG1"
+#define SIGNALD_MSGLOG_INDEX_MAGIC "SGDMIDX1"
+#define SIGNALD_MSGLOG_ALIGN(n) (((n) + 7) & ~(gsize)7)
+
+typedef struct {
+    char magic[8];
+    guint64 capacity; // size of the file
+    guint64 end; // offset of the first byte after the last record
+    guint64 generation; // incremented whenever old records are dropped
+} SignaldMsgLogHeader;
+
+typedef struct {
+    guint32 size; // including this header and padding
+    guint32 outgoing;
+    gint64 timestamp;
+    guint32 conversation_length;
+    guint32 author_length;
+    guint32 text_length;
+    guint32 reserved;
+    // followed by conversation, author and text, each null-terminated
+} SignaldMsgLogRecord;
+
+typedef struct {
+    guint64 conversation; // hash of the conversation
+    gint64 timestamp;
+    guint64 offset; // of the record
+} SignaldMsgLogIndexEntry;
+
+typedef struct {
+    char magic[8];
+    guint64 end; // the log's end when the index was saved
+    guint64 generation; // the log's generation when the index was saved
+    guint64 count;
+} SignaldMsgLogIndexHeader;
+
+struct SignaldMsgLog {
+    gchar *path;
+    gchar *index_path;
+    int fd;
+    char *map;
+    SignaldMsgLogHeader *header; // at the start of map
+    GArray *index; // SignaldMsgLogIndexEntry sorted by conversation, timestamp, offset
+};
+
+/*
+ * 64-bit FNV-1a hash of a conversation name.
+ */
+static guint64
+signald_msglog_hash(const char *conversation)
+{
+    guint64 hash = 14695981039346656037ULL;
+    for (const char *c = conversation; *c; c++) {
+        hash ^= (guchar)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int
+signald_msglog_index_compare(const SignaldMsgLogIndexEntry *a, const SignaldMsgLogIndexEntry *b)
+{
+    if (a->conversation != b->conversation) {
+        return a->conversation < b->conversation ? -1 : 1;
+    }
+    if (a->timestamp != b->timestamp) {
+        return a->timestamp < b->timestamp ? -1 : 1;
+    }
+    return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+/*
+ * Returns the position of the first index entry which is not less than key.
+ */
+static guint
+signald_msglog_index_lower_bound(SignaldMsgLog *log, const SignaldMsgLogIndexEntry *key)
+{
+    guint low = 0;
+    guint high = log->index->len;
+    while (low < high) {
+        guint middle = low + (high - low) / 2;
+        if (signald_msglog_index_compare(&g_array_index(log->index, SignaldMsgLogIndexEntry, middle), key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static SignaldMsgLogRecord *
+signald_msglog_record(SignaldMsgLog *log, guint64 offset)
+{
+    return (SignaldMsgLogRecord *)(log->map + offset);
+}
+
+static const char *
+signald_msglog_record_conversation(SignaldMsgLogRecord *record)
+{
+    return (const char *)(record + 1);
+}
+
+static SignaldMsgLogIndexEntry
+signald_msglog_index_entry(SignaldMsgLog *log, guint64 offset)
+{
+    SignaldMsgLogRecord *record = signald_msglog_record(log, offset);
+    SignaldMsgLogIndexEntry entry = {signald_msglog_hash(signald_msglog_record_conversation(record)), record->timestamp, offset};
+    return entry;
+}
+
+static void
+signald_msglog_index_add(SignaldMsgLog *log, guint64 offset)
+{
+    SignaldMsgLogIndexEntry entry = signald_msglog_index_entry(log, offset);
+    g_array_insert_val(log->index, signald_msglog_index_lower_bound(log, &entry), entry);
+}
+
+/*
+ * Checks whether a complete record starts at offset and ends before end.
+ */
+static gboolean
+signald_msglog_record_valid(SignaldMsgLog *log, guint64 offset, guint64 end)
+{
+    if (offset < sizeof *log->header || offset % 8 != 0 || offset + sizeof(SignaldMsgLogRecord) > end) {
+        return FALSE;
+    }
+    SignaldMsgLogRecord *record = signald_msglog_record(log, offset);
+    return record->size >= sizeof *record && offset + record->size <= end
+        && sizeof *record + (guint64)record->conversation_length + record->author_length + record->text_length + 3 <= record->size
+        && signald_msglog_record_conversation(record)[record->conversation_length] == '\0';
+}
+
+/*
+ * Adds the records in [start, end) of the log to the index.
+ * They are appended and the index is sorted once afterwards (inserting each in place would take quadratic time).
+ * Returns FALSE in case the log is corrupted.
+ */
+static gboolean
+signald_msglog_index_scan(SignaldMsgLog *log, guint64 start)
+{
+    guint64 offset = start;
+    while (offset < log->header->end) {
+        if (!signald_msglog_record_valid(log, offset, log->header->end)) {
+            return FALSE;
+        }
+        SignaldMsgLogIndexEntry entry = signald_msglog_index_entry(log, offset);
+        g_array_append_val(log->index, entry);
+        offset += signald_msglog_record(log, offset)->size;
+    }
+    g_array_sort(log->index, (GCompareFunc)signald_msglog_index_compare);
+    return TRUE;
+}
+
+/*
+ * Checks the entries loaded from the index file against the log, so a damaged file cannot make lookups read beyond the records.
+ * Every entry must point to a record below end and match it, and the entries must be sorted.
+ */
+static gboolean
+signald_msglog_index_valid(SignaldMsgLog *log, guint64 end)
+{
+    for (guint i = 0; i < log->index->len; i++) {
+        SignaldMsgLogIndexEntry *entry = &g_array_index(log->index, SignaldMsgLogIndexEntry, i);
+        if (!signald_msglog_record_valid(log, entry->offset, end)
+            || signald_msglog_record(log, entry->offset)->timestamp != entry->timestamp
+            || (i > 0 && signald_msglog_index_compare(entry - 1, entry) >= 0)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Loads the index saved with the log. Returns the offset up to which records are indexed, 0 in case it is unusable.
+ */
+static guint64
+signald_msglog_index_load(SignaldMsgLog *log)
+{
+    gchar *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(log->index_path, &contents, &length, NULL)) {
+        return 0;
+    }
+    guint64 end = 0;
+    SignaldMsgLogIndexHeader *header = (SignaldMsgLogIndexHeader *)contents;
+    if (length >= sizeof *header && memcmp(header->magic, SIGNALD_MSGLOG_INDEX_MAGIC, sizeof header->magic) == 0
+        && header->generation == log->header->generation && header->end <= log->header->end
+        && header->count == (length - sizeof *header) / sizeof(SignaldMsgLogIndexEntry)
+        && length == sizeof *header + header->count * sizeof(SignaldMsgLogIndexEntry)) {
+        g_array_append_vals(log->index, header + 1, header->count);
+        end = header->end;
+        if (!signald_msglog_index_valid(log, end)) {
+            purple_debug_warning(SIGNALD_PLUGIN_ID, "Message log index %s is damaged, rebuilding it.\n", log->index_path);
+            end = 0;
+        }
+    }
+    g_free(contents);
+    return end;
+}
+
+static void
+signald_msglog_index_save(SignaldMsgLog *log)
+{
+    SignaldMsgLogIndexHeader header = {
+        .end = log->header->end,
+        .generation = log->header->generation,
+        .count = log->index->len,
+    };
+    memcpy(header.magic, SIGNALD_MSGLOG_INDEX_MAGIC, sizeof header.magic);
+    GString *contents = g_string_sized_new(sizeof header + log->index->len * sizeof(SignaldMsgLogIndexEntry));
+    g_string_append_len(contents, (const char *)&header, sizeof header);
+    g_string_append_len(contents, log->index->data, log->index->len * sizeof(SignaldMsgLogIndexEntry));
+    GError *error = NULL;
+    if (!g_file_set_contents(log->index_path, contents->str, contents->len, &error)) {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Cannot save message log index: %s\n", error->message);
+        g_error_free(error);
+    }
+    g_string_free(contents, TRUE);
+}
+
+/*
+ * Opens (or creates) the message log of the account with the given size in bytes.
+ * Returns NULL in case it cannot be opened.
+ */
+SignaldMsgLog *
+signald_msglog_open(PurpleAccount *account, gsize capacity)
+{
+    capacity = MAX(capacity, 2 * sizeof(SignaldMsgLogHeader));
+    gchar *filename = g_strdup_printf("signald-%s.msglog", purple_escape_filename(purple_account_get_username(account)));
+    SignaldMsgLog *log = g_new0(SignaldMsgLog, 1);
+    log->path = g_build_filename(purple_user_dir(), filename, NULL);
+    log->index_path = g_strconcat(log->path, ".idx", NULL);
+    log->index = g_array_new(FALSE, FALSE, sizeof(SignaldMsgLogIndexEntry));
+    g_free(filename);
+
+    log->fd = open(log->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (log->fd < 0 || fstat(log->fd, &st) != 0) {
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Cannot open message log %s: %s\n", log->path, strerror(errno));
+        signald_msglog_close(log);
+        return NULL;
+    }
+    gboolean fresh = st.st_size < (off_t)sizeof(SignaldMsgLogHeader);
+    if (!fresh && (gsize)st.st_size != capacity) {
+        // the configured size changed, start over
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Size of message log changed, discarding it.\n");
+        fresh = TRUE;
+    }
+    if (ftruncate(log->fd, capacity) != 0) {
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Cannot resize message log %s: %s\n", log->path, strerror(errno));
+        signald_msglog_close(log);
+        return NULL;
+    }
+    log->map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+    if (log->map == MAP_FAILED) {
+        log->map = NULL;
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Cannot map message log %s: %s\n", log->path, strerror(errno));
+        signald_msglog_close(log);
+        return NULL;
+    }
+    log->header = (SignaldMsgLogHeader *)log->map;
+    if (fresh || memcmp(log->header->magic, SIGNALD_MSGLOG_MAGIC, sizeof log->header->magic) != 0
+        || log->header->capacity != capacity || log->header->end < sizeof *log->header || log->header->end > capacity) {
+        memset(log->header, 0, sizeof *log->header);
+        memcpy(log->header->magic, SIGNALD_MSGLOG_MAGIC, sizeof log->header->magic);
+        log->header->capacity = capacity;
+        log->header->end = sizeof *log->header;
+        log->header->generation = g_get_real_time(); // does not match any index saved before
+    }
+
+    guint64 indexed = signald_msglog_index_load(log);
+    if (indexed == 0) {
+        g_array_set_size(log->index, 0);
+        indexed = sizeof *log->header;
+    }
+    if (!signald_msglog_index_scan(log, indexed)) {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Message log %s is corrupted, starting over.\n", log->path);
+        g_array_set_size(log->index, 0);
+        log->header->end = sizeof *log->header;
+        log->header->generation++;
+    }
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Message log %s holds %u messages.\n", log->path, log->index->len);
+    return log;
+}
+
+/*
+ * Saves the index and closes the log.
+ */
+void
+signald_msglog_close(SignaldMsgLog *log)
+{
+    if (log->map) {
+        signald_msglog_index_save(log);
+        munmap(log->map, log->header->capacity);
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+    }
+    g_array_free(log->index, TRUE);
+    g_free(log->path);
+    g_free(log->index_path);
+    g_free(log);
+}
+
+/*
+ * Drops the older half of the records to make room.
+ */
+static void
+signald_msglog_compact(SignaldMsgLog *log)
+{
+    guint64 start = sizeof *log->header;
+    guint64 keep = start + (log->header->end - start) / 2;
+    guint64 offset = start;
+    while (offset < keep) {
+        offset += signald_msglog_record(log, offset)->size;
+    }
+    memmove(log->map + start, log->map + offset, log->header->end - offset);
+    log->header->end -= offset - start;
+    log->header->generation++;
+    g_array_set_size(log->index, 0);
+    signald_msglog_index_scan(log, start);
+}
+
+void
+signald_msglog_append(SignaldMsgLog *log, const char *conversation, gint64 timestamp, const char *author, const char *text, gboolean outgoing)
+{
+    if (log == NULL || conversation == NULL || text == NULL) {
+        return;
+    }
+    if (author == NULL) {
+        author = "";
+    }
+    SignaldMsgLogRecord record = {
+        .outgoing = outgoing,
+        .timestamp = timestamp,
+        .conversation_length = strlen(conversation),
+        .author_length = strlen(author),
+        .text_length = strlen(text),
+    };
+    gsize size = SIGNALD_MSGLOG_ALIGN(sizeof record + record.conversation_length + 1 + record.author_length + 1 + record.text_length + 1);
+    gsize available = log->header->capacity - sizeof *log->header;
+    if (size > available / 2) {
+        return; // too large to keep
+    }
+    if (log->header->end + size > log->header->capacity) {
+        signald_msglog_compact(log);
+    }
+    record.size = size;
+    char *target = log->map + log->header->end;
+    memcpy(target, &record, sizeof record);
+    char *data = target + sizeof record;
+    memcpy(data, conversation, record.conversation_length + 1);
+    data += record.conversation_length + 1;
+    memcpy(data, author, record.author_length + 1);
+    data += record.author_length + 1;
+    memcpy(data, text, record.text_length + 1);
+    guint64 offset = log->header->end;
+    log->header->end += size; // the record is complete, publish it
+    signald_msglog_index_add(log, offset);
+}
+
+static void
+signald_msglog_fill_entry(SignaldMsgLogRecord *record, SignaldMsgLogEntry *entry)
+{
+    const char *conversation = signald_msglog_record_conversation(record);
+    entry->timestamp = record->timestamp;
+    entry->outgoing = record->outgoing;
+    entry->author = conversation + record->conversation_length + 1;
+    entry->text = entry->author + record->author_length + 1;
+}
+
+/*
+ * Finds the message with the given timestamp in the conversation.
+ * On success, entry points into the log. It is valid until the next message is appended.
+ */
+gboolean
+signald_msglog_find(SignaldMsgLog *log, const char *conversation, gint64 timestamp, SignaldMsgLogEntry *entry)
+{
+    if (log == NULL || conversation == NULL) {
+        return FALSE;
+    }
+    SignaldMsgLogIndexEntry key = {signald_msglog_hash(conversation), timestamp, 0};
+    for (guint i = signald_msglog_index_lower_bound(log, &key); i < log->index->len; i++) {
+        SignaldMsgLogIndexEntry *candidate = &g_array_index(log->index, SignaldMsgLogIndexEntry, i);
+        if (candidate->conversation != key.conversation || candidate->timestamp != timestamp) {
+            break;
+        }
+        SignaldMsgLogRecord *record = signald_msglog_record(log, candidate->offset);
+        if (purple_strequal(signald_msglog_record_conversation(record), conversation)) {
+            signald_msglog_fill_entry(record, entry);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Finds the newest message in the conversation which contains needle.
+ * On success, entry points into the log. It is valid until the next message is appended.
+ */
+gboolean
+signald_msglog_search(SignaldMsgLog *log, const char *conversation, const char *needle, SignaldMsgLogEntry *entry)
+{
+    if (log == NULL || conversation == NULL) {
+        return FALSE;
+    }
+    guint64 hash = signald_msglog_hash(conversation);
+    SignaldMsgLogIndexEntry key = {hash, G_MAXINT64, G_MAXUINT64};
+    // the conversation's entries precede the key, newest last
+    for (guint i = signald_msglog_index_lower_bound(log, &key); i > 0; i--) {
+        SignaldMsgLogIndexEntry *candidate = &g_array_index(log->index, SignaldMsgLogIndexEntry, i - 1);
+        if (candidate->conversation != hash) {
+            break;
+        }
+        SignaldMsgLogRecord *record = signald_msglog_record(log, candidate->offset);
+        if (purple_strequal(signald_msglog_record_conversation(record), conversation)) {
+            signald_msglog_fill_entry(record, entry);
+            if (strstr(entry->text, needle) != NULL) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Returns the beginning of the text of the message with the given timestamp in the conversation,
+ * NULL if it is not in the log.
+ */
+gchar *
+signald_msglog_excerpt(SignaldMsgLog *log, const char *conversation, gint64 timestamp)
+{
+    SignaldMsgLogEntry entry;
+    if (!signald_msglog_find(log, conversation, timestamp, &entry)) {
+        return NULL;
+    }
+    if (g_utf8_strlen(entry.text, -1) <= SIGNALD_MSGLOG_EXCERPT_LENGTH) {
+        return g_strdup(entry.text);
+    }
+    gchar *start = g_utf8_substring(entry.text, 0, SIGNALD_MSGLOG_EXCERPT_LENGTH);
+    gchar *excerpt = g_strconcat(start, "…", NULL);
+    g_free(start);
+    return excerpt;
+}
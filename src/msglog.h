@@ -0,0 +1,22 @@
+#pragma once
+
+#include "structs.h"
+
+typedef struct {
+    gint64 timestamp;
+    const char *author; // UUID of the author
+    const char *text;
+    gboolean outgoing;
+} SignaldMsgLogEntry;
+
+SignaldMsgLog * signald_msglog_open(PurpleAccount *account, gsize capacity);
+
+void signald_msglog_close(SignaldMsgLog *log);
+
+void signald_msglog_append(SignaldMsgLog *log, const char *conversation, gint64 timestamp, const char *author, const char *text, gboolean outgoing);
+
+gboolean signald_msglog_find(SignaldMsgLog *log, const char *conversation, gint64 timestamp, SignaldMsgLogEntry *entry);
+
+gboolean signald_msglog_search(SignaldMsgLog *log, const char *conversation, const char *needle, SignaldMsgLogEntry *entry);
+
+gchar * signald_msglog_excerpt(SignaldMsgLog *log, const char *conversation, gint64 timestamp);
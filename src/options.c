@@ -67,8 +67,15 @@ signald_add_account_options(GList *account_options)
     }
 
     option = purple_account_option_int_new(
-                "Number of incoming messages to cache for replying",
-                SIGNALD_OPTION_REPLY_CACHE,
+                "Memory for caching messages for replying (in KiB)",
+                SIGNALD_OPTION_REPLY_CACHE_SIZE,
+                0
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_int_new(
+                "Keep recent messages on disk for replies, reactions and receipts (in MiB)",
+                SIGNALD_OPTION_MESSAGE_LOG_SIZE,
                 0
                 );
     account_options = g_list_append(account_options, option);
@@ -80,6 +87,13 @@ signald_add_account_options(GList *account_options)
                 );
     account_options = g_list_append(account_options, option);
 
+    option = purple_account_option_int_new(
+                "Maximum delay of read receipts (in seconds)",
+                SIGNALD_OPTION_RECEIPTS_MAX_AGE,
+                SIGNALD_RECEIPTS_MAX_AGE_DEFAULT
+                );
+    account_options = g_list_append(account_options, option);
+
     option = purple_account_option_bool_new(
                 "Display receipts in conversation",
                 SIGNALD_OPTION_DISPLAY_RECEIPTS,
@@ -129,5 +143,82 @@ signald_add_account_options(GList *account_options)
                 );
     account_options = g_list_append(account_options, option);
 
+    option = purple_account_option_int_new(
+                "Maximum size of incoming messages (MiB)",
+                SIGNALD_OPTION_INPUT_BUFFER_LIMIT,
+                SIGNALD_INPUT_BUFSIZE_LIMIT_DEFAULT
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_bool_new(
+                "Process large replies incrementally",
+                SIGNALD_OPTION_STREAM_INPUT,
+                FALSE
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_int_new(
+                "Incoming messages to handle at once (0 for no limit)",
+                SIGNALD_OPTION_INPUT_FRAME_BUDGET,
+                SIGNALD_INPUT_FRAME_BUDGET_DEFAULT
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_int_new(
+                "Time to spend on incoming messages at once (ms, 0 for no limit)",
+                SIGNALD_OPTION_INPUT_TIME_BUDGET,
+                SIGNALD_INPUT_TIME_BUDGET_DEFAULT
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_bool_new(
+                "Parse incoming messages in a separate thread",
+                SIGNALD_OPTION_INPUT_THREAD,
+                FALSE
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_string_new(
+                "Record incoming data to file (for replay)",
+                SIGNALD_OPTION_RECORD_FILE,
+                ""
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_string_new(
+                "Export metrics to file (Prometheus format)",
+                SIGNALD_OPTION_METRICS_FILE,
+                ""
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_string_new(
+                "Serve metrics on unix socket (Prometheus format)",
+                SIGNALD_OPTION_METRICS_SOCKET,
+                ""
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_string_new(
+                "Trace processing to file (Chrome trace format)",
+                SIGNALD_OPTION_TRACE_FILE,
+                ""
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_int_new(
+                "Frames kept by the flight recorder (0 to disable)",
+                SIGNALD_OPTION_FLIGHT_RECORDER_FRAMES,
+                SIGNALD_FLIGHT_RECORDER_FRAMES_DEFAULT
+                );
+    account_options = g_list_append(account_options, option);
+
+    option = purple_account_option_bool_new(
+                "Redact message content in the flight recorder",
+                SIGNALD_OPTION_FLIGHT_RECORDER_REDACT,
+                TRUE
+                );
+    account_options = g_list_append(account_options, option);
+
     return account_options;
 }
@@ -3,102 +3,537 @@
 #include "comms.h"
 #include "defines.h"
 #include "message.h"
+#include "msglog.h"
+#include "trace.h"
+#include "metrics.h"
 #include <json-glib/json-glib.h>
 
-//static int signald_send_receipt(char * uuid, JsonArray * timestamps, SignaldAccount * sa)
-static int signald_send_receipt(void * vuuid, void * vtimestamps, void * vsa) {
-    char * uuid = vuuid;
-    JsonArray * timestamps = vtimestamps;
-    SignaldAccount * sa = vsa;
+/*
+ * Read receipts are batched per recipient.
+ *
+ * A batch holds a sorted set of timestamps, so marking a message as read repeatedly sends one receipt only.
+ * It is sent once it reaches SIGNALD_RECEIPTS_BATCH_SIZE timestamps or its oldest timestamp has been waiting
+ * for the configured maximum age. The timer only runs while receipts are pending.
+ *
+ * Messages read on another device have had their receipts sent by that device already.
+ * A read sync lists the exact messages, these are dropped from the batches and remembered.
+ * Signal reads a conversation up to a message, so where the conversation of a listed message is known,
+ * everything in the conversation up to it is considered read, too. The conversation is known for messages
+ * received recently (the most recent SIGNALD_RECEIVED_MESSAGES_MAX).
+ */
+
+typedef struct {
+    gchar *key; // author and timestamp
+    gchar *conversation; // group id or the author, NULL if the message has only been seen in a read sync
+    gboolean read_elsewhere; // whether the message has been read on another device
+} SignaldReceivedMessage;
+
+typedef struct {
+    GArray *timestamps; // gint64, sorted, unique
+    gint64 since; // monotonic time at which the first timestamp was added
+} SignaldReceiptBatch;
+
+static void signald_receipts_schedule(SignaldAccount *sa);
+
+static void signald_receipt_batch_free(SignaldReceiptBatch *batch) {
+    g_array_free(batch->timestamps, TRUE);
+    g_free(batch);
+}
+
+static gint64 signald_receipts_max_age(SignaldAccount *sa) {
+    return (gint64)MAX(purple_account_get_int(sa->account, SIGNALD_OPTION_RECEIPTS_MAX_AGE, SIGNALD_RECEIPTS_MAX_AGE_DEFAULT), 0) * G_USEC_PER_SEC;
+}
+
+static void signald_send_receipt(SignaldAccount *sa, const char *uuid, SignaldReceiptBatch *batch) {
     JsonObject *data = json_object_new();
     json_object_set_string_member(data, "type", "mark_read");
     json_object_set_string_member(data, "account", sa->uuid);
     signald_set_recipient(data, "to", uuid);
+    JsonArray *timestamps = json_array_sized_new(batch->timestamps->len);
+    for (guint i = 0; i < batch->timestamps->len; i++) {
+        json_array_add_int_element(timestamps, g_array_index(batch->timestamps, gint64, i));
+    }
     json_object_set_array_member(data, "timestamps", timestamps);
-    if (!signald_send_json(sa, data)) {
+    if (signald_send_json(sa, data)) {
+        sa->receipts_sent += batch->timestamps->len;
+        sa->receipt_requests++;
+        signald_metrics_add(SIGNALD_METRIC_RECEIPTS_SENT, batch->timestamps->len);
+        signald_metrics_increment(SIGNALD_METRIC_RECEIPT_REQUESTS);
+    } else {
         purple_debug_error(SIGNALD_PLUGIN_ID, "Unable to send receipt to %s.\n", uuid);
     }
-    json_array_ref(timestamps); // increase ref counter so the JsonArray still exists when g_hash_table_foreach_remove calls json_array_unref
     json_object_unref(data);
-    return TRUE;
 }
 
-//static int signald_send_receipts(SignaldAccount * sa)
-static int signald_send_receipts(void * vsa) {
-    SignaldAccount * sa = vsa;
-    g_hash_table_foreach_remove(sa->outgoing_receipts, signald_send_receipt, sa);
-    return TRUE;
+/*
+ * Sends all batches which are older than the maximum age.
+ */
+static void signald_send_receipts(SignaldAccount *sa) {
+    gint64 deadline = g_get_monotonic_time() - signald_receipts_max_age(sa);
+    GHashTableIter iter;
+    gpointer uuid;
+    SignaldReceiptBatch *batch;
+    g_hash_table_iter_init(&iter, sa->outgoing_receipts);
+    while (g_hash_table_iter_next(&iter, &uuid, (gpointer *)&batch)) {
+        if (batch->since <= deadline) {
+            signald_send_receipt(sa, uuid, batch);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+}
+
+static gboolean signald_send_receipts_cb(gpointer data) {
+    SignaldAccount *sa = data;
+    sa->receipts_timer = 0;
+    if (signald_output_congested(sa)) {
+        // signald is busy, keep receipts for later
+        sa->receipts_timer = purple_timeout_add_seconds(1, signald_send_receipts_cb, sa);
+        return FALSE;
+    }
+    signald_send_receipts(sa);
+    signald_receipts_schedule(sa);
+    return FALSE;
+}
+
+/*
+ * Arms the timer for the oldest pending batch unless it is running already.
+ */
+static void signald_receipts_schedule(SignaldAccount *sa) {
+    if (sa->receipts_timer != 0 || g_hash_table_size(sa->outgoing_receipts) == 0) {
+        return;
+    }
+    gint64 oldest = G_MAXINT64;
+    GHashTableIter iter;
+    SignaldReceiptBatch *batch;
+    g_hash_table_iter_init(&iter, sa->outgoing_receipts);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&batch)) {
+        oldest = MIN(oldest, batch->since);
+    }
+    gint64 delay = MAX(oldest + signald_receipts_max_age(sa) - g_get_monotonic_time(), 0);
+    sa->receipts_timer = purple_timeout_add(delay / 1000 + 1, signald_send_receipts_cb, sa);
+}
+
+static void signald_sent_messages_init(SignaldAccount *sa);
+
+static void signald_sent_messages_destroy(SignaldAccount *sa);
+
+static void signald_received_message_free(SignaldReceivedMessage *received) {
+    g_free(received->key);
+    g_free(received->conversation);
+    g_free(received);
 }
 
 void signald_receipts_init(SignaldAccount * sa) {
-    sa->outgoing_receipts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)json_array_unref);
-    sa->receipts_timer = purple_timeout_add_seconds(10, signald_send_receipts, sa);
+    signald_sent_messages_init(sa);
+    sa->read_watermarks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    sa->received_messages = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)signald_received_message_free);
+    sa->received_messages_order = g_queue_new();
+    sa->outgoing_receipts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)signald_receipt_batch_free);
 }
 
 void signald_receipts_destroy(SignaldAccount *sa) {
-    purple_timeout_remove(sa->receipts_timer);
+    if (sa->receipts_timer) {
+        purple_timeout_remove(sa->receipts_timer);
+        sa->receipts_timer = 0;
+    }
+    if (sa->receipt_requests > 0) {
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Sent %u receipts in %u requests (%.1f per request), %u duplicates were not sent.\n",
+            sa->receipts_sent, sa->receipt_requests, (double)sa->receipts_sent / sa->receipt_requests, sa->receipt_duplicates);
+    }
+    if (sa->receipts_suppressed > 0) {
+        purple_debug_info(SIGNALD_PLUGIN_ID, "Did not send %u receipts for messages read on another device.\n", sa->receipts_suppressed);
+    }
+    g_hash_table_unref(sa->read_watermarks);
+    g_queue_free(sa->received_messages_order);
+    g_hash_table_unref(sa->received_messages);
     g_hash_table_unref(sa->outgoing_receipts);
+    signald_sent_messages_destroy(sa);
+}
+
+/*
+ * Looks up a received message. Unless it is known already, it is remembered if create is set, NULL is returned otherwise.
+ */
+static SignaldReceivedMessage * signald_received_message(SignaldAccount *sa, const char *author, gint64 timestamp, gboolean create) {
+    gchar *key = g_strdup_printf("%s/%" G_GINT64_FORMAT, author, timestamp);
+    SignaldReceivedMessage *received = g_hash_table_lookup(sa->received_messages, key);
+    if (received != NULL || !create) {
+        g_free(key);
+        return received;
+    }
+    received = g_new0(SignaldReceivedMessage, 1);
+    received->key = key;
+    g_hash_table_insert(sa->received_messages, received->key, received);
+    g_queue_push_head(sa->received_messages_order, received);
+    while (g_queue_get_length(sa->received_messages_order) > SIGNALD_RECEIVED_MESSAGES_MAX) {
+        SignaldReceivedMessage *oldest = g_queue_pop_tail(sa->received_messages_order);
+        g_hash_table_remove(sa->received_messages, oldest->key);
+    }
+    return received;
+}
+
+static PurpleConversation * signald_receipts_find_conversation(SignaldAccount *sa, const char *name) {
+    PurpleConvChat *chat = purple_conversations_find_chat_with_account(name, sa->account);
+    if (chat != NULL) {
+        return chat->conv;
+    }
+    return purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, name, sa->account);
+}
+
+/*
+ * Finds the position of timestamp in the sorted set (or where it would be inserted).
+ * Returns TRUE if it is present.
+ */
+static gboolean signald_receipt_batch_find(SignaldReceiptBatch *batch, gint64 timestamp, guint *position) {
+    guint low = 0;
+    guint high = batch->timestamps->len;
+    while (low < high) {
+        guint middle = low + (high - low) / 2;
+        if (g_array_index(batch->timestamps, gint64, middle) < timestamp) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *position = low;
+    return low < batch->timestamps->len && g_array_index(batch->timestamps, gint64, low) == timestamp;
+}
+
+/*
+ * Inserts timestamp into the sorted set. Returns FALSE if it is present already.
+ */
+static gboolean signald_receipt_batch_add(SignaldReceiptBatch *batch, gint64 timestamp) {
+    guint position;
+    if (signald_receipt_batch_find(batch, timestamp, &position)) {
+        return FALSE;
+    }
+    g_array_insert_val(batch->timestamps, position, timestamp);
+    return TRUE;
+}
+
+/*
+ * Removes timestamp from the sorted set. Returns FALSE if it is not present.
+ */
+static gboolean signald_receipt_batch_remove(SignaldReceiptBatch *batch, gint64 timestamp) {
+    guint position;
+    if (!signald_receipt_batch_find(batch, timestamp, &position)) {
+        return FALSE;
+    }
+    g_array_remove_index(batch->timestamps, position);
+    return TRUE;
 }
 
-void signald_mark_read(SignaldAccount * sa, gint64 timestamp_micro, const char *uuid) {
+static void signald_receipts_count_suppressed(SignaldAccount *sa, guint count) {
+    sa->receipts_suppressed += count;
+    signald_metrics_add(SIGNALD_METRIC_RECEIPTS_SUPPRESSED, count);
+}
+
+/*
+ * Queues a read receipt for the message the author sent at timestamp_micro into the conversation.
+ */
+void signald_mark_read(SignaldAccount * sa, gint64 timestamp_micro, const char *uuid, const char *conversation) {
     g_return_if_fail(uuid != NULL);
+    SignaldReceivedMessage *received = signald_received_message(sa, uuid, timestamp_micro, TRUE);
+    if (received->conversation == NULL) {
+        received->conversation = g_strdup(conversation);
+    }
     PurpleStatus *status = purple_account_get_active_status(sa->account);
     const char *status_id = purple_status_get_id(status);
     gboolean is_online = purple_strequal(status_id, SIGNALD_STATUS_STR_ONLINE);
     gboolean receipts_enabled = purple_account_get_bool(sa->account, SIGNALD_OPTION_MARK_READ, FALSE);
     if (receipts_enabled && is_online) {
-        JsonArray * timestamps = g_hash_table_lookup(sa->outgoing_receipts, uuid);
-        if (timestamps == NULL) {
-            timestamps = json_array_new();
-            g_hash_table_insert(sa->outgoing_receipts, g_strdup(uuid), timestamps);
+        gint64 *watermark = conversation ? g_hash_table_lookup(sa->read_watermarks, conversation) : NULL;
+        if (received->read_elsewhere || (watermark != NULL && timestamp_micro <= *watermark)) {
+            // already read on another device which sent the receipt
+            signald_receipts_count_suppressed(sa, 1);
+            return;
+        }
+        SignaldReceiptBatch *batch = g_hash_table_lookup(sa->outgoing_receipts, uuid);
+        if (batch == NULL) {
+            batch = g_new0(SignaldReceiptBatch, 1);
+            batch->timestamps = g_array_new(FALSE, FALSE, sizeof(gint64));
+            batch->since = g_get_monotonic_time();
+            g_hash_table_insert(sa->outgoing_receipts, g_strdup(uuid), batch);
+        }
+        if (!signald_receipt_batch_add(batch, timestamp_micro)) {
+            sa->receipt_duplicates++;
+            signald_metrics_increment(SIGNALD_METRIC_RECEIPT_DUPLICATES);
+            return;
+        }
+        if (batch->timestamps->len >= SIGNALD_RECEIPTS_BATCH_SIZE && !signald_output_congested(sa)) {
+            signald_send_receipt(sa, uuid, batch);
+            g_hash_table_remove(sa->outgoing_receipts, uuid);
         }
-        json_array_add_int_element(timestamps, timestamp_micro);
+        signald_receipts_schedule(sa);
     }
 }
 
-void signald_mark_read_chat(SignaldAccount * sa, gint64 timestamp_micro, GHashTable *users) {
-    GList * uuids = g_hash_table_get_keys(users);
-    for (const GList *elem = uuids; elem != NULL; elem = elem->next) {
-        signald_mark_read(sa, timestamp_micro, elem->data);
+/*
+ * Removes the pending timestamps of messages in the conversations which are at or below the conversation's watermark.
+ */
+static void signald_receipts_trim(SignaldAccount *sa, GHashTable *conversations) {
+    GHashTableIter iter;
+    gpointer author;
+    SignaldReceiptBatch *batch;
+    g_hash_table_iter_init(&iter, sa->outgoing_receipts);
+    while (g_hash_table_iter_next(&iter, &author, (gpointer *)&batch)) {
+        guint removed = 0;
+        for (guint i = batch->timestamps->len; i > 0; i--) {
+            gint64 timestamp = g_array_index(batch->timestamps, gint64, i - 1);
+            SignaldReceivedMessage *received = signald_received_message(sa, author, timestamp, FALSE);
+            if (received == NULL || received->conversation == NULL || !g_hash_table_contains(conversations, received->conversation)) {
+                continue;
+            }
+            gint64 *watermark = g_hash_table_lookup(sa->read_watermarks, received->conversation);
+            if (timestamp <= *watermark) {
+                g_array_remove_index(batch->timestamps, i - 1);
+                removed++;
+            }
+        }
+        signald_receipts_count_suppressed(sa, removed);
+        if (batch->timestamps->len == 0) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+}
+
+/*
+ * Handles messages which have been read on another device.
+ *
+ * The listed messages are dropped from the pending receipts and remembered, so they are not marked as read later.
+ * The watermark of each conversation a listed message is known to belong to is raised and applied to the pending receipts.
+ * Afterwards, the UI is asked to update the unseen state of these conversations, once per conversation.
+ */
+void signald_process_read_sync(SignaldAccount *sa, JsonArray *read_messages) {
+    GHashTable *conversations = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL); // whose watermark has been raised
+    guint length = json_array_get_length(read_messages);
+    for (guint i = 0; i < length; i++) {
+        JsonObject *read_message = json_array_get_object_element(read_messages, i);
+        const char *author = signald_get_uuid_from_address(read_message, "sender");
+        gint64 timestamp = json_object_get_int_member(read_message, "timestamp");
+        if (author == NULL) {
+            continue;
+        }
+        SignaldReceivedMessage *received = signald_received_message(sa, author, timestamp, TRUE);
+        received->read_elsewhere = TRUE;
+        SignaldReceiptBatch *batch = g_hash_table_lookup(sa->outgoing_receipts, author);
+        if (batch != NULL && signald_receipt_batch_remove(batch, timestamp)) {
+            signald_receipts_count_suppressed(sa, 1);
+            if (batch->timestamps->len == 0) {
+                g_hash_table_remove(sa->outgoing_receipts, author);
+            }
+        }
+        if (received->conversation == NULL) {
+            continue; // not received (yet), the conversation is unknown
+        }
+        gint64 *watermark = g_hash_table_lookup(sa->read_watermarks, received->conversation);
+        if (watermark == NULL) {
+            watermark = g_new(gint64, 1);
+            *watermark = timestamp;
+            g_hash_table_insert(sa->read_watermarks, g_strdup(received->conversation), watermark);
+        } else {
+            *watermark = MAX(*watermark, timestamp);
+        }
+        if (!g_hash_table_contains(conversations, received->conversation)) {
+            g_hash_table_add(conversations, g_strdup(received->conversation));
+        }
+    }
+    if (g_hash_table_size(conversations) > 0) {
+        signald_receipts_trim(sa, conversations);
+    }
+    GHashTableIter iter;
+    gpointer name;
+    g_hash_table_iter_init(&iter, conversations);
+    while (g_hash_table_iter_next(&iter, &name, NULL)) {
+        PurpleConversation *conv = signald_receipts_find_conversation(sa, name);
+        if (conv != NULL) {
+            // how (and whether) the unseen state is tracked is up to the UI, it is only told to look again
+            purple_conversation_update(conv, PURPLE_CONV_UPDATE_UNSEEN);
+        }
+    }
+    g_hash_table_destroy(conversations);
+}
+
+/*
+ * Receipts for our own messages are folded into the state of the message they refer to.
+ *
+ * Sent messages are indexed by timestamp (the most recent SIGNALD_SENT_MESSAGES_MAX).
+ * A receipt updates the state of each message it lists. Messages which changed are shown
+ * in their conversation once per SIGNALD_RECEIPTS_DISPLAY_DELAY_MS, one line per message, one write per conversation.
+ */
+
+typedef struct {
+    gint64 timestamp;
+    gchar *conversation; // recipient or group id
+    gchar *excerpt; // beginning of the text
+    GHashTable *readers; // uuid → SignaldReceiptState
+    gboolean changed; // whether the state changed since it was shown
+} SignaldSentMessage;
+
+typedef enum {
+    SIGNALD_RECEIPT_STATE_DELIVERED = 1,
+    SIGNALD_RECEIPT_STATE_READ,
+    SIGNALD_RECEIPT_STATE_VIEWED,
+} SignaldReceiptState;
+
+static void signald_sent_message_free(SignaldSentMessage *sent) {
+    g_free(sent->conversation);
+    g_free(sent->excerpt);
+    g_hash_table_destroy(sent->readers);
+    g_free(sent);
+}
+
+static void signald_sent_messages_init(SignaldAccount *sa) {
+    sa->sent_messages = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)signald_sent_message_free);
+    sa->sent_messages_order = g_queue_new();
+}
+
+static void signald_sent_messages_destroy(SignaldAccount *sa) {
+    if (sa->receipts_display_timer) {
+        purple_timeout_remove(sa->receipts_display_timer);
+        sa->receipts_display_timer = 0;
     }
-    g_list_free(uuids);
+    g_queue_free(sa->sent_messages_order);
+    g_hash_table_destroy(sa->sent_messages);
+}
+
+/*
+ * Remembers a message we sent (from this or another device), so receipts can be mapped to it.
+ */
+void signald_sent_messages_add(SignaldAccount *sa, const char *conversation, gint64 timestamp, const char *text) {
+    if (conversation == NULL || !purple_account_get_bool(sa->account, SIGNALD_OPTION_DISPLAY_RECEIPTS, FALSE)) {
+        return;
+    }
+    SignaldSentMessage *sent = g_new0(SignaldSentMessage, 1);
+    sent->timestamp = timestamp;
+    sent->conversation = g_strdup(conversation);
+    if (text != NULL && g_utf8_strlen(text, -1) > SIGNALD_MSGLOG_EXCERPT_LENGTH) {
+        gchar *start = g_utf8_substring(text, 0, SIGNALD_MSGLOG_EXCERPT_LENGTH);
+        sent->excerpt = g_strconcat(start, "…", NULL);
+        g_free(start);
+    } else {
+        sent->excerpt = g_strdup(text);
+    }
+    sent->readers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    if (g_hash_table_lookup(sa->sent_messages, &sent->timestamp)) {
+        g_queue_remove(sa->sent_messages_order, g_hash_table_lookup(sa->sent_messages, &sent->timestamp));
+    }
+    g_hash_table_replace(sa->sent_messages, &sent->timestamp, sent);
+    g_queue_push_head(sa->sent_messages_order, sent);
+    while (g_queue_get_length(sa->sent_messages_order) > SIGNALD_SENT_MESSAGES_MAX) {
+        SignaldSentMessage *oldest = g_queue_pop_tail(sa->sent_messages_order);
+        g_hash_table_remove(sa->sent_messages, &oldest->timestamp);
+    }
+}
+
+static void signald_string_free(GString *string) {
+    g_string_free(string, TRUE);
+}
+
+static void signald_sent_message_describe(SignaldSentMessage *sent, PurpleConversation *conv, GString *out) {
+    guint delivered = 0, read = 0, viewed = 0;
+    GHashTableIter iter;
+    gpointer state;
+    g_hash_table_iter_init(&iter, sent->readers);
+    while (g_hash_table_iter_next(&iter, NULL, &state)) {
+        delivered += GPOINTER_TO_INT(state) >= SIGNALD_RECEIPT_STATE_DELIVERED;
+        read += GPOINTER_TO_INT(state) >= SIGNALD_RECEIPT_STATE_READ;
+        viewed += GPOINTER_TO_INT(state) >= SIGNALD_RECEIPT_STATE_VIEWED;
+    }
+    time_t time = sent->timestamp / 1000;
+    g_string_append_printf(out, "Message from %s", purple_time_format(localtime(&time)));
+    if (sent->excerpt != NULL && sent->excerpt[0]) {
+        gchar *escaped = g_markup_escape_text(sent->excerpt, -1);
+        g_string_append_printf(out, " (\"%s\")", escaped);
+        g_free(escaped);
+    }
+    if (purple_conversation_get_type(conv) == PURPLE_CONV_TYPE_CHAT) {
+        g_string_append_printf(out, ": delivered to %u, read by %u", delivered, read);
+        if (viewed > 0) {
+            g_string_append_printf(out, ", viewed by %u", viewed);
+        }
+    } else {
+        g_string_append(out, viewed ? ": viewed" : read ? ": read" : ": delivered");
+    }
+}
+
+/*
+ * Shows the state of all changed messages, one write per conversation.
+ */
+static gboolean signald_receipts_display_cb(gpointer data) {
+    SignaldAccount *sa = data;
+    sa->receipts_display_timer = 0;
+    GHashTable *updates = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)signald_string_free); // conversation → GString
+    // oldest first, so the lines are in order
+    for (GList *iter = sa->sent_messages_order->tail; iter != NULL; iter = iter->prev) {
+        SignaldSentMessage *sent = iter->data;
+        if (!sent->changed) {
+            continue;
+        }
+        sent->changed = FALSE;
+        PurpleConversation *conv = signald_receipts_find_conversation(sa, sent->conversation);
+        if (conv == NULL) {
+            continue; // only shown if the conversation is currently open
+        }
+        GString *update = g_hash_table_lookup(updates, conv);
+        if (update == NULL) {
+            update = g_string_new(NULL);
+            g_hash_table_insert(updates, conv, update);
+        } else {
+            g_string_append(update, "<br>");
+        }
+        signald_sent_message_describe(sent, conv, update);
+    }
+    GHashTableIter iter;
+    gpointer conv;
+    GString *update;
+    g_hash_table_iter_init(&iter, updates);
+    while (g_hash_table_iter_next(&iter, &conv, (gpointer *)&update)) {
+        gint64 start = signald_trace_begin();
+        purple_conversation_write(conv, NULL, update->str, PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
+        signald_trace_end("purple_conversation_write", "receipts", start);
+    }
+    g_hash_table_destroy(updates);
+    return FALSE;
 }
 
 void signald_process_receipt(SignaldAccount *sa, JsonObject *obj) {
-    if (purple_account_get_bool(sa->account, SIGNALD_OPTION_DISPLAY_RECEIPTS, FALSE)) {
-        // receipts carry no groupV2 information
-        // source is always the reader
-        JsonObject * source = json_object_get_object_member(obj, "source");
-        const gchar * who = json_object_get_string_member(source, "uuid");
-        PurpleConversation * conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, who, sa->account);
-        if (conv) {
-            // only display receipt if the conversation is currently open
-            
-            JsonObject * receipt_message = json_object_get_object_member(obj, "receipt_message");
-            const gchar * type = json_object_get_string_member(receipt_message, "type");
-            gint64 when = json_object_get_int_member(receipt_message, "when");
-            time_t timestamp = when / 1000;
-
-            // concatenate list of timestamps into one message
-            GString *message = g_string_new(type);
-            message = g_string_append(message, " receipt for message from ");
-            JsonArray * timestamps = json_object_get_array_member(receipt_message, "timestamps");
-            GList * timestamp_list = json_array_get_elements(timestamps);
-            for (GList * elem = timestamp_list; elem != NULL ; elem = elem->next) {
-                guint64 timestamp_micro = json_node_get_int(elem->data);
-                time_t timestamp = timestamp_micro / 1000;
-                struct tm *tm = localtime(&timestamp);
-                message = g_string_append(message, purple_date_format_long(tm));
-                if (elem->next) {
-                    message = g_string_append(message, ", ");
-                }
+    if (!purple_account_get_bool(sa->account, SIGNALD_OPTION_DISPLAY_RECEIPTS, FALSE)) {
+        return;
+    }
+    // source is always the reader
+    JsonObject * source = json_object_get_object_member(obj, "source");
+    const gchar * who = json_object_get_string_member(source, "uuid");
+    JsonObject * receipt_message = json_object_get_object_member(obj, "receipt_message");
+    const gchar * type = json_object_get_string_member(receipt_message, "type");
+    SignaldReceiptState state = SIGNALD_RECEIPT_STATE_DELIVERED;
+    if (purple_strequal(type, "READ")) {
+        state = SIGNALD_RECEIPT_STATE_READ;
+    } else if (purple_strequal(type, "VIEWED")) {
+        state = SIGNALD_RECEIPT_STATE_VIEWED;
+    }
+    JsonArray * timestamps = json_object_get_array_member(receipt_message, "timestamps");
+    guint length = timestamps ? json_array_get_length(timestamps) : 0;
+    for (guint i = 0; i < length; i++) {
+        gint64 timestamp = json_array_get_int_element(timestamps, i);
+        SignaldSentMessage *sent = g_hash_table_lookup(sa->sent_messages, &timestamp);
+        SignaldMsgLogEntry logged;
+        if (sent == NULL && signald_msglog_find(sa->msglog, who, timestamp, &logged) && logged.outgoing) {
+            // a direct message which is older than the table (or from a previous session), the reader is the conversation
+            signald_sent_messages_add(sa, who, timestamp, logged.text);
+            sent = g_hash_table_lookup(sa->sent_messages, &timestamp);
+        }
+        if (sent == NULL) {
+            // receipts carry no groupV2 information, so group messages which are not known cannot be placed
+            purple_debug_info(SIGNALD_PLUGIN_ID, "Ignoring %s receipt for unknown message %" G_GINT64_FORMAT ".\n", type, timestamp);
+            continue;
+        }
+        SignaldReceiptState previous = GPOINTER_TO_INT(g_hash_table_lookup(sent->readers, who));
+        if (state > previous) {
+            g_hash_table_insert(sent->readers, g_strdup(who), GINT_TO_POINTER(state));
+            sent->changed = TRUE;
+            if (sa->receipts_display_timer == 0) {
+                sa->receipts_display_timer = purple_timeout_add(SIGNALD_RECEIPTS_DISPLAY_DELAY_MS, signald_receipts_display_cb, sa);
             }
-            g_list_free(timestamp_list);
-            
-            PurpleMessageFlags flags = PURPLE_MESSAGE_NO_LOG;
-            purple_conv_im_write(PURPLE_CONV_IM(conv), who, message->str, flags, timestamp);
-            
-            g_string_free(message, TRUE);
         }
     }
 }
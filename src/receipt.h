@@ -7,8 +7,10 @@ void signald_receipts_init(SignaldAccount *sa);
 
 void signald_receipts_destroy(SignaldAccount *sa);
 
-void signald_mark_read(SignaldAccount *sa, gint64 timestamp_micro, const char *uuid);
+void signald_mark_read(SignaldAccount *sa, gint64 timestamp_micro, const char *uuid, const char *conversation);
 
-void signald_mark_read_chat(SignaldAccount *sa, gint64 timestamp_micro, GHashTable *users);
+void signald_process_read_sync(SignaldAccount *sa, JsonArray *read_messages);
+
+void signald_sent_messages_add(SignaldAccount *sa, const char *conversation, gint64 timestamp, const char *text);
 
 void signald_process_receipt(SignaldAccount *sa, JsonObject *obj);
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <sys/resource.h> // for getrusage
+#include "purple_compat.h"
+#include "defines.h"
+#include "connection.h"
+#include "json-utils.h"
+#include "harness.h"
+
+/*
+ * Replaying recorded input for measurements (the signald-replay executable).
+ *
+ * With the account option SIGNALD_OPTION_RECORD_FILE set, everything signald sends is appended to that file.
+ * Such a file (or a synthetic one with one JSON message per line) can be replayed by this program.
+ * It runs the plugin in a headless libpurple core with a sandbox account of its own (see harness.c),
+ * so replayed messages are handled as usual, but nothing is sent to signald or shown to the user.
+ * Each message is written into the sandbox's socket, acting as signald. The plugin reads and handles it like
+ * a message coming from signald: signald_read_cb, framing, the work budget, the stream scanner or the worker thread
+ * (as configured with --option) up to signald_connection_dispatch.
+ * The time from writing a message until it has been dispatched is measured.
+ * Lines which are not JSON objects are skipped, since they would make the plugin drop the connection.
+ * Afterwards, messages per second, latency percentiles per type and the peak resident set size are reported.
+ *
+ * Usage: signald-replay [--account UUID] [--repeat N] [--option NAME=VALUE...] FILE...
+ */
+
+typedef struct {
+    gchar *type;
+    GArray *durations; // of gint64, in microseconds
+} SignaldReplayType;
+
+static void
+signald_replay_type_free(gpointer data)
+{
+    SignaldReplayType *replay_type = data;
+    g_free(replay_type->type);
+    g_array_free(replay_type->durations, TRUE);
+    g_free(replay_type);
+}
+
+static gint
+signald_replay_compare_durations(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *)a;
+    gint64 y = *(const gint64 *)b;
+    return (x > y) - (x < y);
+}
+
+static gint
+signald_replay_compare_types(gconstpointer a, gconstpointer b)
+{
+    const SignaldReplayType *x = a;
+    const SignaldReplayType *y = b;
+    return g_strcmp0(x->type, y->type);
+}
+
+/*
+ * Returns the p-th percentile of sorted durations (nearest rank).
+ */
+static gint64
+signald_replay_percentile(GArray *durations, guint p)
+{
+    guint rank = (durations->len * p + 99) / 100;
+    return g_array_index(durations, gint64, MAX(rank, 1) - 1);
+}
+
+/*
+ * Replays the file into the account. Durations are collected per type.
+ */
+static gboolean
+signald_replay_file(SignaldAccount *sa, const char *filename, GHashTable *types, guint *frames, guint *invalid)
+{
+    gchar *contents = NULL;
+    gsize length = 0;
+    GError *error = NULL;
+    if (!g_file_get_contents(filename, &contents, &length, &error)) {
+        fprintf(stderr, "Cannot read %s: %s\n", filename, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    JsonParser *parser = json_parser_new();
+    char *end = contents + length;
+    for (char *line = contents; line < end; ) {
+        char *newline = memchr(line, '\n', end - line);
+        gsize line_length = (newline ? newline : end) - line;
+        if (line_length > 0 && json_parser_load_from_data(parser, line, line_length, NULL) && JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+            JsonNode *root = json_parser_get_root(parser);
+            const char *type = json_object_get_string_member_or_null(json_node_get_object(root), "type");
+            if (type == NULL) {
+                type = "(none)";
+            }
+            SignaldReplayType *replay_type = g_hash_table_lookup(types, type);
+            if (replay_type == NULL) {
+                replay_type = g_new0(SignaldReplayType, 1);
+                replay_type->type = g_strdup(type);
+                replay_type->durations = g_array_new(FALSE, FALSE, sizeof(gint64));
+                g_hash_table_insert(types, replay_type->type, replay_type);
+            }
+            // the line is written including its newline (if there is none at the end of the file, the buffer's null-terminator is replaced)
+            gboolean terminated = newline != NULL;
+            line[line_length] = '\n';
+            gint64 before = g_get_monotonic_time();
+            gboolean handled = signald_harness_feed(sa, line, line_length + 1, 1);
+            gint64 duration = g_get_monotonic_time() - before;
+            if (!terminated) {
+                line[line_length] = '\0';
+            }
+            if (!handled) {
+                fprintf(stderr, "The sandbox connection failed while replaying %s.\n", filename);
+                g_object_unref(parser);
+                g_free(contents);
+                return FALSE;
+            }
+            g_array_append_val(replay_type->durations, duration);
+            (*frames)++;
+        } else if (line_length > 0) {
+            (*invalid)++;
+        }
+        line += line_length + 1;
+    }
+    g_object_unref(parser);
+    g_free(contents);
+    return TRUE;
+}
+
+static void
+signald_replay_report(GHashTable *types, guint frames, guint invalid, guint requests, gint64 elapsed)
+{
+    struct rusage usage = {0};
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("Replayed %u messages in %.3f s (%.0f messages per second), skipped %u invalid lines.\n", frames, elapsed / 1e6, frames * 1e6 / elapsed, invalid);
+    printf("Requests which would have been sent to signald: %u\n", requests);
+    printf("Peak resident set size: %ld KiB\n\n", usage.ru_maxrss);
+    printf("Time from writing until dispatched per type in µs (count, p50, p90, p99, max):\n");
+    GList *sorted = g_list_sort(g_hash_table_get_values(types), signald_replay_compare_types);
+    for (GList *iter = sorted; iter != NULL; iter = iter->next) {
+        SignaldReplayType *replay_type = iter->data;
+        GArray *durations = replay_type->durations;
+        g_array_sort(durations, signald_replay_compare_durations);
+        printf("%s: %u, %" G_GINT64_FORMAT ", %" G_GINT64_FORMAT ", %" G_GINT64_FORMAT ", %" G_GINT64_FORMAT "\n",
+            replay_type->type, durations->len,
+            signald_replay_percentile(durations, 50), signald_replay_percentile(durations, 90), signald_replay_percentile(durations, 99),
+            g_array_index(durations, gint64, durations->len - 1));
+    }
+    g_list_free(sorted);
+}
+
+int
+main(int argc, char **argv)
+{
+    gchar *account = NULL;
+    gint repeat = 1;
+    gchar **options = NULL;
+    GOptionEntry entries[] = {
+        {"account", 'a', 0, G_OPTION_ARG_STRING, &account, "UUID of the sandbox account (own UUID in sync messages)", "UUID"},
+        {"repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "Number of times the files are replayed", "N"},
+        {"option", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &options, "Account option of the sandbox account, e.g. input-thread=true", "NAME=VALUE"},
+        {NULL}
+    };
+    GOptionContext *context = g_option_context_new("FILE... - replay recorded signald input");
+    g_option_context_add_main_entries(context, entries, NULL);
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error) || argc < 2) {
+        fprintf(stderr, "%s\n", error ? error->message : "No file given.");
+        g_clear_error(&error);
+        g_option_context_free(context);
+        return 2;
+    }
+    g_option_context_free(context);
+
+    if (!signald_harness_init()) {
+        return 1;
+    }
+    SignaldAccount *sa = signald_harness_account_new(account ? account : "00000000-0000-4000-8000-000000000000", options);
+    g_strfreev(options);
+    if (sa == NULL) {
+        fprintf(stderr, "Cannot log in the sandbox account.\n");
+        signald_harness_shutdown();
+        return 1;
+    }
+
+    GHashTable *types = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, signald_replay_type_free);
+    guint frames = 0;
+    guint invalid = 0;
+    gboolean success = TRUE;
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < repeat && success; i++) {
+        for (int f = 1; f < argc && success; f++) {
+            success = signald_replay_file(sa, argv[f], types, &frames, &invalid);
+        }
+    }
+    gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+    if (success) {
+        signald_replay_report(types, frames, invalid, sa->connection->sandbox_requests, elapsed);
+        signald_harness_account_free(sa);
+    }
+    g_hash_table_destroy(types);
+
+    signald_harness_shutdown();
+    g_free(account);
+    return success ? 0 : 1;
+}
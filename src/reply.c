@@ -1,60 +1,353 @@
 #include "reply.h"
 #include "defines.h"
 #include "message.h"
+#include "msglog.h"
 
-GQueue * signald_replycache_init() {
-    return g_queue_new();
+/*
+ * Cache of recent messages for quoting them in replies.
+ *
+ * Messages are stored in an arena of fixed size which is used as a ring buffer:
+ * Each entry (header, author and text) is written after the newest one. In case it does not fit, the oldest entries are evicted.
+ * Evicting an entry only moves the tail of the ring, the index is not touched.
+ *
+ * The index is partitioned by conversation. Within a conversation, every trigram (three consecutive bytes)
+ * of a message's text maps to references to the messages containing it, oldest first.
+ * A needle is looked up via its rarest trigram, so only few candidates need to be checked with strstr.
+ * References carry the entry's sequence number. They are stale once it is lower than the oldest one in the arena.
+ * Lookups ignore stale references. They are removed from the index each time the ring wraps around.
+ *
+ * The index usually needs more memory than the texts, so it is counted against the cache's size, too:
+ * A quarter of the size goes to the arena, the rest is left for the index. In case the index exceeds its share,
+ * the oldest entries are evicted until their references make up half of it and the stale references are removed.
+ */
+
+#define SIGNALD_REPLYCACHE_ARENA_SHARE 4 // the arena takes 1/SIGNALD_REPLYCACHE_ARENA_SHARE of the size
+
+typedef struct {
+    guint64 seq; // sequence number
+    gint64 id; // timestamp of the message
+    guint32 size; // bytes occupied in the arena including this header and padding
+    guint32 text_offset; // offset of the text relative to the header, the author comes right after the header
+    guint32 refs; // number of references to this entry in the index
+} SignaldReplyEntry;
+
+typedef struct {
+    guint64 seq;
+    gsize offset; // of the entry in the arena
+} SignaldReplyRef;
+
+typedef struct {
+    GArray *messages; // SignaldReplyRef to all messages, oldest first
+    GHashTable *trigrams; // trigram → GArray of SignaldReplyRef (oldest first, each message once)
+} SignaldReplyConversation;
+
+struct SignaldReplyCache {
+    char *arena;
+    gsize size; // capacity of the arena in bytes
+    gsize index_limit; // bytes which may be occupied by references in the index
+    gsize head; // offset for the next entry
+    gsize tail; // offset of the oldest entry
+    gsize wrap_end; // end of the entries before the wrap-around, only valid while wrapped
+    gboolean wrapped; // whether entries are stored in [tail, wrap_end) and [0, head) rather than [tail, head)
+    gsize used; // bytes occupied by entries
+    guint count; // number of entries
+    guint64 next_seq; // sequence number of the next entry
+    guint64 oldest_seq; // sequence number of the oldest entry
+    gsize index_bytes; // bytes occupied by references in the index
+    gsize stale_bytes; // bytes occupied by references to evicted entries
+    GHashTable *conversations; // name → SignaldReplyConversation
+};
+
+#define SIGNALD_REPLYCACHE_TRIGRAM(s) GUINT_TO_POINTER(((guint)(guchar)(s)[0] << 16) | ((guint)(guchar)(s)[1] << 8) | (guchar)(s)[2])
+#define SIGNALD_REPLYCACHE_ALIGN(n) (((n) + 7) & ~(gsize)7)
+
+static void
+signald_replycache_conversation_free(SignaldReplyConversation *conversation)
+{
+    g_array_free(conversation->messages, TRUE);
+    g_hash_table_destroy(conversation->trigrams);
+    g_free(conversation);
 }
 
-static void signald_replycache_message_free(SignaldMessage *message) {
-    g_return_if_fail(message != NULL);
-    g_free(message->author_uuid);
-    g_free(message->text);
-    g_free(message);
+static void
+signald_replycache_refs_free(gpointer refs)
+{
+    g_array_free(refs, TRUE);
 }
 
-void signald_replycache_free(GQueue *queue) {
-    g_queue_free_full(queue, (GDestroyNotify)signald_replycache_message_free);
+/*
+ * Creates a cache which occupies about size bytes for the arena and the index.
+ */
+SignaldReplyCache * signald_replycache_init(gsize size) {
+    SignaldReplyCache *cache = g_new0(SignaldReplyCache, 1);
+    cache->size = SIGNALD_REPLYCACHE_ALIGN(size / SIGNALD_REPLYCACHE_ARENA_SHARE);
+    cache->arena = g_malloc(cache->size);
+    cache->index_limit = size - MIN(size, cache->size);
+    cache->next_seq = 1;
+    cache->oldest_seq = 1;
+    cache->conversations = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)signald_replycache_conversation_free);
+    return cache;
 }
 
-void signald_replycache_add_message(SignaldAccount *sa, PurpleConversation *conv, const char *author_uuid, guint64 timestamp_micro, const char *body) {
-    if (body != NULL) {
-        const int capacity = purple_account_get_int(sa->account, SIGNALD_OPTION_REPLY_CACHE, 0);
-        if (capacity > 0) {
-            SignaldMessage *msg = g_new0(SignaldMessage, 1);
-            msg->conversation = conv;
-            msg->author_uuid = g_strdup(author_uuid);
-            msg->text = g_strdup(body);
-            msg->id = timestamp_micro;
-            g_queue_push_head(sa->replycache, msg);
+void signald_replycache_free(SignaldReplyCache *cache) {
+    g_hash_table_destroy(cache->conversations);
+    g_free(cache->arena);
+    g_free(cache);
+}
+
+/*
+ * Removes the oldest entry from the arena.
+ */
+static void
+signald_replycache_evict(SignaldReplyCache *cache)
+{
+    SignaldReplyEntry *entry = (SignaldReplyEntry *)(cache->arena + cache->tail);
+    cache->tail += entry->size;
+    cache->used -= entry->size;
+    cache->oldest_seq = entry->seq + 1;
+    cache->stale_bytes += entry->refs * sizeof(SignaldReplyRef);
+    cache->count--;
+    if (cache->wrapped && cache->tail == cache->wrap_end) {
+        cache->tail = 0;
+        cache->wrapped = FALSE;
+    }
+}
+
+/*
+ * Removes the references which precede the first one with seq >= oldest_seq.
+ * Returns TRUE if refs is empty afterwards.
+ */
+static gboolean
+signald_replycache_refs_trim(SignaldReplyCache *cache, GArray *refs)
+{
+    guint stale = 0;
+    while (stale < refs->len && g_array_index(refs, SignaldReplyRef, stale).seq < cache->oldest_seq) {
+        stale++;
+    }
+    if (stale > 0) {
+        g_array_remove_range(refs, 0, stale);
+        cache->index_bytes -= stale * sizeof(SignaldReplyRef);
+    }
+    return refs->len == 0;
+}
+
+/*
+ * Removes all stale references (and conversations without messages) from the index.
+ */
+static void
+signald_replycache_sweep(SignaldReplyCache *cache)
+{
+    GHashTableIter conversations;
+    SignaldReplyConversation *conversation = NULL;
+    g_hash_table_iter_init(&conversations, cache->conversations);
+    while (g_hash_table_iter_next(&conversations, NULL, (gpointer *)&conversation)) {
+        if (signald_replycache_refs_trim(cache, conversation->messages)) {
+            // all trigrams of the conversation are stale, too
+            GHashTableIter trigrams;
+            GArray *refs = NULL;
+            g_hash_table_iter_init(&trigrams, conversation->trigrams);
+            while (g_hash_table_iter_next(&trigrams, NULL, (gpointer *)&refs)) {
+                cache->index_bytes -= refs->len * sizeof(SignaldReplyRef);
+            }
+            g_hash_table_iter_remove(&conversations);
+            continue;
         }
-        while (g_queue_get_length(sa->replycache) > capacity) {
-            g_queue_pop_tail(sa->replycache);
+        GHashTableIter trigrams;
+        GArray *refs = NULL;
+        g_hash_table_iter_init(&trigrams, conversation->trigrams);
+        while (g_hash_table_iter_next(&trigrams, NULL, (gpointer *)&refs)) {
+            if (signald_replycache_refs_trim(cache, refs)) {
+                g_hash_table_iter_remove(&trigrams);
+            }
         }
     }
+    cache->stale_bytes = 0;
 }
 
-static int signald_replycache_predicate(SignaldMessage * msg, const char* needle) {
-    return !(strstr(msg->text, needle) != NULL);
+/*
+ * Evicts the oldest entries (except for the newest) until the index is within its share again.
+ */
+static void
+signald_replycache_shrink_index(SignaldReplyCache *cache)
+{
+    if (cache->index_bytes <= cache->index_limit) {
+        return;
+    }
+    while (cache->count > 1 && cache->index_bytes - cache->stale_bytes > cache->index_limit / 2) {
+        signald_replycache_evict(cache);
+    }
+    signald_replycache_sweep(cache);
 }
 
-SignaldMessage * signald_replycache_check(SignaldAccount *sa, const gchar *message) {
-    g_return_val_if_fail(message != NULL, NULL);
-    if (message[0] == '@') {
-        char * colon = strchr(message, ':');
-        if (colon != NULL) {
-            const size_t needle_len = colon-message-1;
-            char * needle = g_new0(char, needle_len);
-            strncpy(needle, message+1, needle_len);
-            GList * elem = g_queue_find_custom(sa->replycache, needle, (GCompareFunc)signald_replycache_predicate);
-            if (elem != NULL) {
-                return (SignaldMessage *)elem->data;
+/*
+ * Makes room for an entry of need bytes, evicting old entries as necessary.
+ * Returns the offset for the entry.
+ */
+static gsize
+signald_replycache_reserve(SignaldReplyCache *cache, gsize need)
+{
+    if (cache->count == 0) {
+        cache->head = cache->tail = 0;
+        cache->wrapped = FALSE;
+    }
+    while (TRUE) {
+        if (!cache->wrapped) {
+            if (cache->size - cache->head >= need) {
+                break;
             }
+            // wrap around, the space at the end remains unused
+            cache->wrap_end = cache->head;
+            cache->head = 0;
+            cache->wrapped = TRUE;
+            signald_replycache_sweep(cache);
+        } else if (cache->tail - cache->head >= need) {
+            break;
+        } else {
+            signald_replycache_evict(cache);
+        }
+    }
+    gsize offset = cache->head;
+    cache->head += need;
+    return offset;
+}
+
+static void
+signald_replycache_refs_append(SignaldReplyCache *cache, GArray *refs, SignaldReplyEntry *entry, const SignaldReplyRef *ref)
+{
+    // a message is referenced only once per trigram
+    if (refs->len == 0 || g_array_index(refs, SignaldReplyRef, refs->len - 1).seq != ref->seq) {
+        g_array_append_vals(refs, ref, 1);
+        cache->index_bytes += sizeof *ref;
+        entry->refs++;
+    }
+}
+
+void signald_replycache_add_message(SignaldAccount *sa, PurpleConversation *conv, const char *author_uuid, guint64 timestamp_micro, const char *body) {
+    SignaldReplyCache *cache = sa->replycache;
+    if (body == NULL || conv == NULL || cache == NULL) {
+        return;
+    }
+    if (author_uuid == NULL) {
+        author_uuid = "";
+    }
+    gsize author_length = strlen(author_uuid);
+    gsize text_length = strlen(body);
+    gsize need = SIGNALD_REPLYCACHE_ALIGN(sizeof(SignaldReplyEntry) + author_length + 1 + text_length + 1);
+    if (need > cache->size || need > G_MAXUINT32 || (text_length + 1) * sizeof(SignaldReplyRef) > cache->index_limit) {
+        return; // does not fit at all
+    }
+    gsize offset = signald_replycache_reserve(cache, need);
+    SignaldReplyEntry *entry = (SignaldReplyEntry *)(cache->arena + offset);
+    entry->seq = cache->next_seq++;
+    entry->id = timestamp_micro;
+    entry->size = need;
+    entry->text_offset = sizeof *entry + author_length + 1;
+    entry->refs = 0;
+    memcpy(entry + 1, author_uuid, author_length + 1);
+    char *text = (char *)entry + entry->text_offset;
+    memcpy(text, body, text_length + 1);
+    cache->used += need;
+    cache->count++;
+
+    const char *name = purple_conversation_get_name(conv);
+    SignaldReplyConversation *conversation = g_hash_table_lookup(cache->conversations, name);
+    if (conversation == NULL) {
+        conversation = g_new0(SignaldReplyConversation, 1);
+        conversation->messages = g_array_new(FALSE, FALSE, sizeof(SignaldReplyRef));
+        conversation->trigrams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, signald_replycache_refs_free);
+        g_hash_table_insert(cache->conversations, g_strdup(name), conversation);
+    }
+    SignaldReplyRef ref = {entry->seq, offset};
+    signald_replycache_refs_append(cache, conversation->messages, entry, &ref);
+    for (const char *s = text; s[0] && s[1] && s[2]; s++) {
+        GArray *refs = g_hash_table_lookup(conversation->trigrams, SIGNALD_REPLYCACHE_TRIGRAM(s));
+        if (refs == NULL) {
+            refs = g_array_new(FALSE, FALSE, sizeof(SignaldReplyRef));
+            g_hash_table_insert(conversation->trigrams, SIGNALD_REPLYCACHE_TRIGRAM(s), refs);
+        }
+        signald_replycache_refs_append(cache, refs, entry, &ref);
+    }
+    signald_replycache_shrink_index(cache);
+}
+
+/*
+ * Finds the newest message of the conversation which contains needle. Returns NULL if there is none.
+ */
+static SignaldReplyEntry *
+signald_replycache_find(SignaldReplyCache *cache, SignaldReplyConversation *conversation, const char *needle)
+{
+    GArray *candidates = conversation->messages;
+    if (strlen(needle) >= 3) {
+        // every match contains all trigrams of the needle, so the shortest list suffices
+        candidates = NULL;
+        for (const char *s = needle; s[2]; s++) {
+            GArray *refs = g_hash_table_lookup(conversation->trigrams, SIGNALD_REPLYCACHE_TRIGRAM(s));
+            if (refs == NULL) {
+                return NULL;
+            }
+            if (candidates == NULL || refs->len < candidates->len) {
+                candidates = refs;
+            }
+        }
+    }
+    for (guint i = candidates->len; i > 0; i--) {
+        const SignaldReplyRef *ref = &g_array_index(candidates, SignaldReplyRef, i - 1);
+        if (ref->seq < cache->oldest_seq) {
+            break; // this and all older messages have been evicted
+        }
+        SignaldReplyEntry *entry = (SignaldReplyEntry *)(cache->arena + ref->offset);
+        if (strstr((char *)entry + entry->text_offset, needle) != NULL) {
+            return entry;
         }
     }
     return NULL;
 }
 
+/*
+ * Looks up the message a reply refers to by the needle in "@needle: reply".
+ * Messages which are not in the cache (any more) are looked up in the message log.
+ * On success, reply points into the cache or log. It is valid until the next message is added.
+ */
+gboolean signald_replycache_check(SignaldAccount *sa, const char *conversation_name, const gchar *message, SignaldMessage *reply) {
+    g_return_val_if_fail(message != NULL, FALSE);
+    SignaldReplyCache *cache = sa->replycache;
+    if (message[0] != '@' || (cache == NULL && sa->msglog == NULL)) {
+        return FALSE;
+    }
+    char * colon = strchr(message, ':');
+    if (colon == NULL) {
+        return FALSE;
+    }
+    gchar *needle = g_strndup(message + 1, colon - message - 1);
+    gboolean found = FALSE;
+    SignaldReplyConversation *conversation = cache ? g_hash_table_lookup(cache->conversations, conversation_name) : NULL;
+    SignaldReplyEntry *entry = conversation ? signald_replycache_find(cache, conversation, needle) : NULL;
+    SignaldMsgLogEntry logged;
+    if (entry != NULL) {
+        reply->id = entry->id;
+        reply->author_uuid = (const char *)(entry + 1);
+        reply->text = (const char *)entry + entry->text_offset;
+        found = TRUE;
+    } else if (signald_msglog_search(sa->msglog, conversation_name, needle, &logged)) {
+        reply->id = logged.timestamp;
+        reply->author_uuid = logged.author;
+        reply->text = logged.text;
+        found = TRUE;
+    }
+    g_free(needle);
+    return found;
+}
+
+/*
+ * Reports the number of cached messages and the memory occupied by them.
+ */
+void signald_replycache_get_statistics(SignaldReplyCache *cache, guint *messages, gsize *used, gsize *arena, gsize *index) {
+    *messages = cache ? cache->count : 0;
+    *used = cache ? cache->used : 0;
+    *arena = cache ? cache->size : 0;
+    *index = cache ? cache->index_bytes : 0;
+}
+
 const gchar * signald_replycache_strip_needle(const gchar * message) {
     // find separator
     message = strchr(message, ':') + 1;
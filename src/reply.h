@@ -5,19 +5,20 @@
 #include "structs.h"
 
 typedef struct {
-    PurpleConversation *conversation;
-    char *author_uuid;
+    const char *author_uuid;
     gint64 id;
-    char *text;
+    const char *text;
 } SignaldMessage;
 
-GQueue * signald_replycache_init();
+SignaldReplyCache * signald_replycache_init(gsize size);
 
-void signald_replycache_free(GQueue *queue);
+void signald_replycache_free(SignaldReplyCache *cache);
 
 void signald_replycache_add_message(SignaldAccount *sa, PurpleConversation *conv, const char *author_uuid, guint64 timestamp_micro, const char *body);
 
-SignaldMessage * signald_replycache_check(SignaldAccount *sa, const gchar *message);
+gboolean signald_replycache_check(SignaldAccount *sa, const char *conversation_name, const gchar *message, SignaldMessage *reply);
+
+void signald_replycache_get_statistics(SignaldReplyCache *cache, guint *messages, gsize *used, gsize *arena, gsize *index);
 
 const gchar * signald_replycache_strip_needle(const gchar * message);
 
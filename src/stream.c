@@ -0,0 +1,309 @@
+#include "stream.h"
+#include "purple_compat.h"
+#include "defines.h"
+#include "comms.h"
+#include "contacts.h"
+#include "groups.h"
+#include "connection.h"
+#include "trace.h"
+#include "flight-recorder.h"
+
+/*
+ * Incremental scanning of incoming frames.
+ *
+ * Replies like list_contacts or list_groups carry one large array in their data object.
+ * Instead of waiting for the entire frame, the scanner keeps track of the JSON structure as the bytes arrive.
+ * Each element of such an array is parsed and handed to its handler as soon as it is complete.
+ * Afterwards, its bytes are removed from the input buffer. The remaining frame (now with an empty array) is handled as usual.
+ *
+ * Only the top-level object, its data object and the array within are tracked in detail.
+ * Framing is the same as in signald_read_cb: Every newline terminates a frame.
+ *
+ * Elements are handed to the account the frame is meant for. In case it cannot be determined
+ * by the time the array starts (by the frame's id or account), the frame is handled as a whole.
+ */
+
+#define SIGNALD_STREAM_KEY_MAX 32 // keys of interest are short, longer ones are not recorded
+#define SIGNALD_STREAM_VALUE_MAX 64 // for values of interest (id and account)
+#define SIGNALD_STREAM_TRACKED_DEPTH 3
+
+typedef void (*SignaldStreamElementHandler)(SignaldAccount *sa, JsonNode *element);
+
+typedef struct {
+    const char *type; // type of the frame
+    const char *member; // name of the array in the frame's data object
+    SignaldStreamElementHandler handler;
+} SignaldStreamableArray;
+
+static void
+signald_stream_process_group(SignaldAccount *sa, JsonNode *element)
+{
+    signald_process_groupV2_obj(sa, json_node_get_object(element));
+}
+
+static const SignaldStreamableArray signald_streamable_arrays[] = {
+    {"list_contacts", "profiles", signald_process_contact},
+    {"list_groups", "groups", signald_stream_process_group},
+};
+
+struct SignaldStream {
+    JsonParser *parser; // re-used for all elements
+    gsize scanned; // number of bytes of the current frame which have been scanned already
+    gsize removed; // number of bytes which have been removed from the current frame
+    int depth; // current nesting depth
+    gboolean malformed; // whether the frame closed more containers than it opened, it is not scanned any further
+    char containers[SIGNALD_STREAM_TRACKED_DEPTH + 1]; // type of container ('{' or '[') per tracked depth
+    gboolean expect_key; // whether the next string is a key
+    gboolean in_string;
+    gboolean escaped;
+    gboolean is_key; // whether the current string is a key
+    gsize string_start;
+    char keys[SIGNALD_STREAM_TRACKED_DEPTH][SIGNALD_STREAM_KEY_MAX]; // most recent key per tracked depth
+    char type[SIGNALD_STREAM_KEY_MAX]; // value of the frame's type member
+    char id[SIGNALD_STREAM_VALUE_MAX]; // value of the frame's id member
+    char account[SIGNALD_STREAM_VALUE_MAX]; // value of the frame's account member
+    const SignaldStreamableArray *array; // the array currently being streamed, NULL otherwise
+    SignaldAccount *target; // the account the streamed elements are handed to
+    gsize element_start; // offset of the first byte after the opening bracket of the streamed array
+};
+
+SignaldStream *
+signald_stream_new(void)
+{
+    SignaldStream *stream = g_new0(SignaldStream, 1);
+    stream->parser = json_parser_new();
+    return stream;
+}
+
+void
+signald_stream_free(SignaldStream *stream)
+{
+    g_return_if_fail(stream != NULL);
+    g_object_unref(stream->parser);
+    g_free(stream);
+}
+
+static void
+signald_stream_reset(SignaldStream *stream)
+{
+    JsonParser *parser = stream->parser;
+    memset(stream, 0, sizeof *stream);
+    stream->parser = parser;
+}
+
+/*
+ * Stops handing elements to the account (which is leaving the connection).
+ * The rest of the frame is handled as a whole.
+ */
+void
+signald_stream_drop_account(SignaldStream *stream, SignaldAccount *sa)
+{
+    if (stream->target == sa) {
+        stream->array = NULL;
+        stream->target = NULL;
+    }
+}
+
+/*
+ * Stores a string from the frame in target (with the given capacity) unless it is too long.
+ */
+static void
+signald_stream_copy_string(char *target, gsize capacity, const char *start, gsize length)
+{
+    if (length < capacity) {
+        memcpy(target, start, length);
+        target[length] = 0;
+    } else {
+        target[0] = 0;
+    }
+}
+
+static const SignaldStreamableArray *
+signald_stream_find_array(SignaldStream *stream)
+{
+    // the array must be a member of the top-level object's data object
+    if (stream->depth != 2 || stream->containers[1] != '{' || stream->containers[2] != '{' || !purple_strequal(stream->keys[1], "data")) {
+        return NULL;
+    }
+    for (gsize i = 0; i < G_N_ELEMENTS(signald_streamable_arrays); i++) {
+        const SignaldStreamableArray *array = &signald_streamable_arrays[i];
+        if (purple_strequal(stream->type, array->type) && purple_strequal(stream->keys[2], array->member)) {
+            return array;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Determines the account the frame is meant for, NULL if this is not known (yet).
+ */
+static SignaldAccount *
+signald_stream_find_account(SignaldConnection *conn, SignaldStream *stream)
+{
+    if (stream->id[0]) {
+        // responses to requests which are not pending are not handled at all
+        return signald_requests_lookup_account(conn, stream->id);
+    }
+    return signald_connection_find_account(conn, stream->account[0] ? stream->account : NULL);
+}
+
+/*
+ * Parses an element of the streamed array and hands it to the array's handler.
+ * The element is recorded like a frame since it is removed from the frame before the frame is complete.
+ */
+static void
+signald_stream_deliver(SignaldConnection *conn, SignaldStream *stream, const char *element, gsize length)
+{
+    // skip elements consisting of whitespace only (e.g. in empty arrays)
+    gsize i = 0;
+    while (i < length && g_ascii_isspace(element[i])) {
+        i++;
+    }
+    if (i == length) {
+        return;
+    }
+    signald_flight_recorder_add_raw(conn, element, length, length);
+    gint64 start = signald_trace_begin();
+    gboolean parsed = json_parser_load_from_data(stream->parser, element, length, NULL) && json_parser_get_root(stream->parser) != NULL;
+    signald_trace_end("parse", stream->type, start);
+    if (parsed) {
+        start = signald_trace_begin();
+        stream->array->handler(stream->target, json_parser_get_root(stream->parser));
+        signald_trace_end("handle", stream->type, start);
+    } else {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Ignoring unparsable element of %s.\n", stream->type);
+    }
+}
+
+/*
+ * Removes the bytes [start, end) from the current frame.
+ */
+static void
+signald_stream_remove(SignaldStream *stream, char *frame, gsize start, gsize end, char *buffer_end)
+{
+    memmove(frame + start, frame + end, buffer_end - (frame + end));
+    stream->removed += end - start;
+}
+
+/*
+ * Scans the bytes which arrived since the last call.
+ * Elements of streamable arrays are handed to their handlers and removed from the buffer, reducing *length.
+ * Complete frames are handed to the parser.
+ * Scanning stops early once the work budget is exhausted, it is resumed with the next call.
+ * Returns the number of bytes which have been consumed. Bytes after that belong to an incomplete or unhandled frame.
+ */
+gsize
+signald_stream_handle(SignaldConnection *conn, char *buffer, gsize *length)
+{
+    SignaldStream *stream = conn->input_stream;
+    char *frame = buffer;
+    gsize i = stream->scanned;
+    while (frame + i < buffer + *length && !signald_input_budget_exhausted(conn)) {
+        const char c = frame[i];
+        if (c == '\n') {
+            // every newline terminates a frame (even if it is malformed)
+            conn->input_frame_peak = MAX(conn->input_frame_peak, i + 1 + stream->removed);
+            signald_handle_frame(conn, frame, i);
+            signald_input_budget_spend(conn);
+            frame += i + 1;
+            i = 0;
+            signald_stream_reset(stream);
+            continue;
+        }
+        if (stream->malformed) {
+            // skip to the end of the frame, the parser reports the error
+            const char *newline = memchr(frame + i, '\n', buffer + *length - (frame + i));
+            i = (newline ? newline : buffer + *length) - frame;
+            continue;
+        }
+        if (stream->in_string) {
+            if (stream->escaped) {
+                stream->escaped = FALSE;
+            } else if (c == '\\') {
+                stream->escaped = TRUE;
+            } else if (c == '"') {
+                stream->in_string = FALSE;
+                if (stream->depth == 1 || stream->depth == 2) {
+                    const char *start = frame + stream->string_start;
+                    gsize string_length = i - stream->string_start;
+                    if (stream->is_key) {
+                        signald_stream_copy_string(stream->keys[stream->depth], SIGNALD_STREAM_KEY_MAX, start, string_length);
+                    } else if (stream->depth == 1 && purple_strequal(stream->keys[1], "type")) {
+                        signald_stream_copy_string(stream->type, sizeof stream->type, start, string_length);
+                    } else if (stream->depth == 1 && purple_strequal(stream->keys[1], "id")) {
+                        signald_stream_copy_string(stream->id, sizeof stream->id, start, string_length);
+                    } else if (stream->depth == 1 && purple_strequal(stream->keys[1], "account")) {
+                        signald_stream_copy_string(stream->account, sizeof stream->account, start, string_length);
+                    }
+                }
+            }
+            i++;
+            continue;
+        }
+        switch (c) {
+            case '"':
+                stream->in_string = TRUE;
+                stream->is_key = stream->expect_key;
+                stream->string_start = i + 1;
+                break;
+            case '{':
+            case '[':
+                if (c == '[' && stream->array == NULL) {
+                    stream->array = signald_stream_find_array(stream);
+                    stream->element_start = i + 1;
+                    if (stream->array != NULL) {
+                        stream->target = signald_stream_find_account(conn, stream);
+                        if (stream->target == NULL) {
+                            purple_debug_info(SIGNALD_PLUGIN_ID, "Recipient of %s is unknown, not streaming.\n", stream->type);
+                            stream->array = NULL;
+                        }
+                    }
+                }
+                stream->depth++;
+                if (stream->depth >= 1 && stream->depth <= SIGNALD_STREAM_TRACKED_DEPTH) {
+                    stream->containers[stream->depth] = c;
+                }
+                stream->expect_key = (c == '{');
+                break;
+            case ']':
+                if (stream->array != NULL && stream->depth == SIGNALD_STREAM_TRACKED_DEPTH) {
+                    // end of the last element
+                    signald_stream_deliver(conn, stream, frame + stream->element_start, i - stream->element_start);
+                    signald_input_budget_spend(conn);
+                    signald_stream_remove(stream, frame, stream->element_start, i, buffer + *length);
+                    *length -= i - stream->element_start;
+                    i = stream->element_start;
+                    stream->array = NULL;
+                }
+                // fall-through
+            case '}':
+                if (stream->depth == 0) {
+                    stream->malformed = TRUE;
+                    break;
+                }
+                stream->depth--;
+                stream->expect_key = FALSE;
+                break;
+            case ',':
+                if (stream->array != NULL && stream->depth == SIGNALD_STREAM_TRACKED_DEPTH) {
+                    // end of an element, remove it together with the comma
+                    signald_stream_deliver(conn, stream, frame + stream->element_start, i - stream->element_start);
+                    signald_input_budget_spend(conn);
+                    signald_stream_remove(stream, frame, stream->element_start, i + 1, buffer + *length);
+                    *length -= i + 1 - stream->element_start;
+                    i = stream->element_start;
+                    continue;
+                }
+                stream->expect_key = stream->depth >= 1 && stream->depth <= SIGNALD_STREAM_TRACKED_DEPTH && stream->containers[stream->depth] == '{';
+                break;
+            case ':':
+                stream->expect_key = FALSE;
+                break;
+            default:
+                break;
+        }
+        i++;
+    }
+    stream->scanned = i;
+    return frame - buffer;
+}
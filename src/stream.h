@@ -0,0 +1,11 @@
+#pragma once
+
+#include "structs.h"
+
+SignaldStream * signald_stream_new(void);
+
+void signald_stream_free(SignaldStream *stream);
+
+void signald_stream_drop_account(SignaldStream *stream, SignaldAccount *sa);
+
+gsize signald_stream_handle(SignaldConnection *conn, char *buffer, gsize *length);
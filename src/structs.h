@@ -1,9 +1,66 @@
 #pragma once
 
+#include <stdio.h>
 #include <purple.h>
 #include <json-glib/json-glib.h>
 
-#define SIGNALD_INPUT_BUFSIZE 500000 // TODO: research actual maximum message size
+typedef struct SignaldStream SignaldStream;
+typedef struct SignaldWorker SignaldWorker;
+typedef struct SignaldConnector SignaldConnector;
+typedef struct SignaldLatency SignaldLatency;
+typedef struct SignaldFlightRecorder SignaldFlightRecorder;
+typedef struct SignaldReplyCache SignaldReplyCache;
+typedef struct SignaldMsgLog SignaldMsgLog;
+
+/*
+ * A connection to signald. It is shared by all accounts using the same socket location.
+ */
+typedef struct {
+    gchar *key; // socket location as configured, empty for the default locations
+    GList *accounts; // of SignaldAccount, one reference each
+
+    SignaldConnector *connector; // state of connecting to signald, NULL unless connecting
+    int fd;
+    int readflags;
+    guint watcher;
+    char *input_buffer; // buffer for incoming data, grows as needed
+    gsize input_buffer_size; // current capacity of input_buffer
+    gsize input_buffer_length; // number of bytes of an incomplete frame currently held in input_buffer
+    gsize input_buffer_limit; // maximum capacity of input_buffer
+    gsize input_frame_peak; // size of the largest frame received so far
+    SignaldStream *input_stream; // state of incremental parsing, NULL unless enabled
+    SignaldWorker *input_worker; // thread for reading and parsing, NULL unless enabled
+    FILE *input_record; // file all input is appended to, NULL unless enabled
+    int input_budget_frames_limit; // number of frames which may be handled per main loop iteration, 0 if unlimited
+    int input_budget_milliseconds_limit; // time which may be spent per main loop iteration, 0 if unlimited
+    int input_budget_frames; // number of frames which may still be handled in this main loop iteration, negative if unlimited
+    gint64 input_budget_deadline; // monotonic time at which handling frames must be deferred
+    guint input_backlog_timer; // handler for idle callback which handles deferred frames
+    guint input_backlog_frames; // number of frames which have been deferred
+    GQueue *output_queue; // GStrings waiting to be written to signald
+    GQueue *output_pool; // GStrings which have been written, kept for re-use
+    gsize output_queue_bytes; // number of bytes in output_queue which have not been written, yet
+    gsize output_offset; // number of bytes of the head of output_queue which have been written already
+    guint output_watcher; // write watcher, only active while output_queue is not empty
+    gboolean output_congested; // whether output_queue exceeded the high watermark and did not drain below the low watermark, yet
+
+    guint next_request_id; // id for the next request sent to signald
+    GHashTable *pending_requests; // requests waiting for a response, by id
+    guint pending_requests_timer; // handler for timer which checks for timed out requests
+
+    gchar *metrics_file; // file the metrics are exported to, NULL if disabled
+    guint metrics_timer; // handler for timer which writes metrics_file
+    gchar *metrics_socket; // path of the socket the metrics are served on, NULL if disabled
+    int metrics_listener; // listening socket for metrics, -1 if disabled
+    guint metrics_watcher; // accept watcher for metrics_listener
+
+    gboolean trace; // whether this connection enabled tracing
+    gboolean sandbox; // whether this is a sandbox for replaying input, nothing is sent to signald (see harness.c)
+    guint sandbox_requests; // number of requests which would have been sent to signald
+    int sandbox_peer; // the other end of the sandbox's socket, input for the sandbox is written to it
+    guint sandbox_frames; // number of frames the sandbox dispatched
+    SignaldFlightRecorder *flight_recorder; // recent frames, NULL if disabled
+} SignaldConnection;
 
 typedef struct {
     PurpleAccount *account;
@@ -13,22 +70,25 @@ typedef struct {
 
     gboolean account_exists; // whether account exists in signald
 
-    int socket_paths_count;
-    int fd;
-    int readflags;
-    guint watcher;
-    char input_buffer[SIGNALD_INPUT_BUFSIZE];
-    char * input_buffer_position;
-
-    char *last_message; // the last message which has been sent to signald
-    PurpleConversation *last_conversation; // the conversation the message is relevant to
+    SignaldConnection *connection; // shared with other accounts
     
-    GQueue *replycache; // cache of messages for "reply to" function
+    SignaldReplyCache *replycache; // cache of messages for "reply to" function
+    SignaldMsgLog *msglog; // persistent log of recent messages, NULL if disabled
+
+    SignaldLatency *latency; // delivery latency of recent incoming messages
     
-    guint receipts_timer; // handler for timer which sends receipts
-    GHashTable *outgoing_receipts; // buffer for receipts
+    guint receipts_timer; // handler for timer which sends receipts, only active while receipts are pending
+    GHashTable *outgoing_receipts; // buffer for receipts, recipient → batch
+    guint receipts_sent; // number of timestamps sent in receipts
+    guint receipt_requests; // number of requests receipts were sent in
+    guint receipt_duplicates; // number of timestamps which were pending already
+    guint receipts_suppressed; // number of timestamps which had been read on another device
+    GHashTable *read_watermarks; // conversation → timestamp of the most recent message read on another device
+    GHashTable *received_messages; // recently received (and read) messages by author and timestamp
+    GQueue *received_messages_order; // the same messages, most recent first
+    GHashTable *sent_messages; // recently sent messages by timestamp, for mapping receipts to them
+    GQueue *sent_messages_order; // the same messages, most recent first
+    guint receipts_display_timer; // handler for timer which shows changed receipt states, only active while changes are pending
 
     PurpleRoomlist *roomlist;
-    
-    char *show_profile; // name of the user-requested profile (NULL in case of system-requested profile)
 } SignaldAccount;
@@ -0,0 +1,88 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "purple_compat.h"
+#include "defines.h"
+
+/*
+ * Trace of processing spans in Chrome's trace event format (as understood by Perfetto and chrome://tracing).
+ *
+ * Every span is written as a complete event with the id of the thread it ran on.
+ * The file is a JSON array which is never closed. This is allowed by the format, so the trace stays usable in case of a crash.
+ * Tracing is process-wide. Spans may be recorded from the input worker thread, too.
+ */
+
+gboolean signald_trace_enabled = FALSE;
+static FILE *signald_trace_file = NULL;
+static gint64 signald_trace_epoch = 0;
+static GMutex signald_trace_lock;
+
+/*
+ * Starts tracing to the file at path, replacing its contents.
+ * Returns FALSE if the file cannot be opened or tracing is active already.
+ */
+gboolean
+signald_trace_open(const char *path)
+{
+    g_mutex_lock(&signald_trace_lock);
+    gboolean opened = FALSE;
+    if (signald_trace_file == NULL) {
+        signald_trace_file = fopen(path, "w");
+        if (signald_trace_file != NULL) {
+            fputs("[\n", signald_trace_file);
+            signald_trace_epoch = g_get_monotonic_time();
+            g_atomic_int_set(&signald_trace_enabled, TRUE);
+            opened = TRUE;
+        } else {
+            purple_debug_error(SIGNALD_PLUGIN_ID, "Cannot trace to %s: %s\n", path, strerror(errno));
+        }
+    }
+    g_mutex_unlock(&signald_trace_lock);
+    return opened;
+}
+
+void
+signald_trace_close(void)
+{
+    g_mutex_lock(&signald_trace_lock);
+    g_atomic_int_set(&signald_trace_enabled, FALSE);
+    if (signald_trace_file != NULL) {
+        fclose(signald_trace_file);
+        signald_trace_file = NULL;
+    }
+    g_mutex_unlock(&signald_trace_lock);
+}
+
+/*
+ * Writes a span which began at start (monotonic time in µs) and ends now.
+ * detail (may be NULL) is added as argument, e.g. the type of the frame being handled.
+ */
+void
+signald_trace_write(const char *name, const char *detail, gint64 start)
+{
+    gint64 end = g_get_monotonic_time();
+    long tid = syscall(SYS_gettid);
+    g_mutex_lock(&signald_trace_lock);
+    if (signald_trace_file != NULL) {
+        fprintf(signald_trace_file, "{\"name\":\"%s\",\"cat\":\"signald\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%ld",
+            name, MAX(start - signald_trace_epoch, 0), end - start, getpid(), tid);
+        if (detail != NULL) {
+            fputs(",\"args\":{\"detail\":\"", signald_trace_file);
+            for (const char *c = detail; *c; c++) {
+                if (*c == '"' || *c == '\\') {
+                    fputc('\\', signald_trace_file);
+                    fputc(*c, signald_trace_file);
+                } else if ((unsigned char)*c < 0x20) {
+                    fprintf(signald_trace_file, "\\u%04x", *c);
+                } else {
+                    fputc(*c, signald_trace_file);
+                }
+            }
+            fputs("\"}", signald_trace_file);
+        }
+        fputs("},\n", signald_trace_file);
+    }
+    g_mutex_unlock(&signald_trace_lock);
+}
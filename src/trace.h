@@ -0,0 +1,32 @@
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Spans are recorded like this:
+ *
+ *     gint64 start = signald_trace_begin();
+ *     …
+ *     signald_trace_end("name", NULL, start);
+ *
+ * While tracing is disabled, this amounts to checking a flag.
+ */
+
+extern gboolean signald_trace_enabled;
+
+#define signald_trace_begin() (signald_trace_enabled ? g_get_monotonic_time() : 0)
+
+void signald_trace_write(const char *name, const char *detail, gint64 start);
+
+static inline void
+signald_trace_end(const char *name, const char *detail, gint64 start)
+{
+    // spans which began while tracing was disabled are not recorded
+    if (start != 0) {
+        signald_trace_write(name, detail, start);
+    }
+}
+
+gboolean signald_trace_open(const char *path);
+
+void signald_trace_close(void);
@@ -0,0 +1,383 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "worker.h"
+#include "purple_compat.h"
+#include "defines.h"
+#include "comms.h"
+#include "connection.h"
+#include "trace.h"
+#include "flight-recorder.h"
+
+/*
+ * Reading and parsing in a separate thread.
+ *
+ * The worker thread reads from the socket, splits the input into frames and parses them.
+ * The resulting JSON trees are handed to the main thread through a single-producer/single-consumer ring.
+ * The main thread is woken up through a pipe. It runs the handlers within the usual work budget.
+ *
+ * The worker must not call any purple functions. Errors are passed through the ring, too.
+ * The ring is lock-free. Only if it is full, the worker waits on a condition until the main thread catches up.
+ */
+
+#define SIGNALD_WORKER_QUEUE_LENGTH 256
+
+typedef struct {
+    JsonNode *node; // parsed frame, NULL in case of an error
+    gsize length; // length of the frame in bytes
+    gchar *error; // message for a connection error, NULL unless node is NULL
+    gchar *raw; // copy of the beginning of a frame which could not be parsed (for the flight recorder), NULL otherwise
+} SignaldWorkerItem;
+
+struct SignaldWorker {
+    SignaldConnection *conn;
+    int fd;
+    pthread_t thread;
+    gboolean running;
+    int wakeup[2]; // main thread → worker, wakes up the worker for stopping
+    int notify[2]; // worker → main thread, announces new items
+    guint notify_watcher;
+    guint drain_timer; // handler for idle callback which handles items deferred due to the work budget
+
+    SignaldWorkerItem items[SIGNALD_WORKER_QUEUE_LENGTH];
+    gint head; // number of items produced, written by the worker only
+    gint tail; // number of items consumed, written by the main thread only
+    gint notified; // whether the main thread has been notified and did not look at the ring since
+    gint waiting; // whether the worker is waiting for space in the ring
+    gint stop; // whether the worker should stop
+    GMutex lock; // protects waiting on space
+    GCond space;
+
+    // owned by the worker while it runs
+    char *buffer;
+    gsize buffer_size;
+    gsize buffer_length;
+    gsize buffer_limit;
+    gsize frame_peak;
+};
+
+SignaldWorker *
+signald_worker_new(SignaldConnection *conn)
+{
+    SignaldWorker *worker = g_new0(SignaldWorker, 1);
+    worker->conn = conn;
+    worker->fd = -1;
+    worker->wakeup[0] = worker->wakeup[1] = -1;
+    worker->notify[0] = worker->notify[1] = -1;
+    g_mutex_init(&worker->lock);
+    g_cond_init(&worker->space);
+    return worker;
+}
+
+void
+signald_worker_free(SignaldWorker *worker)
+{
+    g_return_if_fail(worker != NULL);
+    signald_worker_stop(worker);
+    g_mutex_clear(&worker->lock);
+    g_cond_clear(&worker->space);
+    g_free(worker);
+}
+
+/*
+ * Worker side: Appends an item to the ring. Waits in case the ring is full.
+ * Returns FALSE in case the worker has been asked to stop while waiting.
+ */
+static gboolean
+signald_worker_push(SignaldWorker *worker, JsonNode *node, gsize length, gchar *error, gchar *raw)
+{
+    gint head = worker->head;
+    if (head - g_atomic_int_get(&worker->tail) == SIGNALD_WORKER_QUEUE_LENGTH) {
+        g_mutex_lock(&worker->lock);
+        g_atomic_int_set(&worker->waiting, TRUE);
+        while (head - g_atomic_int_get(&worker->tail) == SIGNALD_WORKER_QUEUE_LENGTH && !g_atomic_int_get(&worker->stop)) {
+            g_cond_wait(&worker->space, &worker->lock);
+        }
+        g_atomic_int_set(&worker->waiting, FALSE);
+        g_mutex_unlock(&worker->lock);
+        if (g_atomic_int_get(&worker->stop)) {
+            if (node) {
+                json_node_free(node);
+            }
+            g_free(error);
+            g_free(raw);
+            return FALSE;
+        }
+    }
+    SignaldWorkerItem *item = &worker->items[head % SIGNALD_WORKER_QUEUE_LENGTH];
+    item->node = node;
+    item->length = length;
+    item->error = error;
+    item->raw = raw;
+    g_atomic_int_set(&worker->head, head + 1); // publishes the item
+    if (g_atomic_int_compare_and_exchange(&worker->notified, FALSE, TRUE)) {
+        char c = 0;
+        if (write(worker->notify[1], &c, 1) < 0) {
+            // the pipe is full, so the main thread will be woken up anyway
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Worker side: Parses the complete frames in the buffer and moves the incomplete rest to the beginning.
+ * Returns FALSE in case the worker should stop. The frame which could not be pushed then stays in the buffer, too.
+ */
+static gboolean
+signald_worker_handle_frames(SignaldWorker *worker, JsonParser *parser, gsize scan_offset)
+{
+    char *frame = worker->buffer;
+    char *end = worker->buffer + worker->buffer_length;
+    char *newline = memchr(worker->buffer + scan_offset, '\n', end - (worker->buffer + scan_offset));
+    gboolean proceed = TRUE;
+    while (newline != NULL && proceed) {
+        worker->frame_peak = MAX(worker->frame_peak, (gsize)(newline + 1 - frame));
+        gint64 start = signald_trace_begin();
+        gboolean parsed = json_parser_load_from_data(parser, frame, newline - frame, NULL) && json_parser_get_root(parser) != NULL;
+        signald_trace_end("parse", NULL, start);
+        if (parsed) {
+            proceed = signald_worker_push(worker, json_parser_steal_root(parser), newline - frame, NULL, NULL);
+        } else {
+            // the recorder belongs to the main thread, it gets a copy
+            gchar *raw = g_strndup(frame, MIN((gsize)(newline - frame), SIGNALD_FLIGHT_RECORDER_EXCERPT));
+            proceed = signald_worker_push(worker, NULL, newline - frame, g_strdup("Error parsing input."), raw);
+        }
+        if (!proceed) {
+            break; // the frame is handed back to the main thread by signald_worker_stop
+        }
+        frame = newline + 1;
+        newline = memchr(frame, '\n', end - frame);
+    }
+    worker->buffer_length = end - frame;
+    memmove(worker->buffer, frame, worker->buffer_length);
+    return proceed;
+}
+
+static void *
+signald_worker_run(void *arg)
+{
+    SignaldWorker *worker = arg;
+    JsonParser *parser = json_parser_new(); // re-used for all frames
+    struct pollfd fds[] = {
+        {.fd = worker->fd, .events = POLLIN},
+        {.fd = worker->wakeup[0], .events = POLLIN},
+    };
+    while (!g_atomic_int_get(&worker->stop)) {
+        if (poll(fds, G_N_ELEMENTS(fds), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            signald_worker_push(worker, NULL, 0, g_strdup_printf("Waiting for signald failed: %s", strerror(errno)), NULL);
+            break;
+        }
+        if (fds[1].revents) {
+            break; // asked to stop
+        }
+        // one byte is always kept spare, see signald_read_cb
+        if (worker->buffer_length + 1 == worker->buffer_size) {
+            if (worker->buffer_size >= worker->buffer_limit) {
+                signald_worker_push(worker, NULL, 0, g_strdup("message exceeded buffer size"), NULL);
+                break;
+            }
+            worker->buffer_size = MIN(worker->buffer_size * 2, worker->buffer_limit);
+            worker->buffer = g_realloc(worker->buffer, worker->buffer_size);
+        }
+        gint64 start = signald_trace_begin();
+        gssize read = recv(worker->fd, worker->buffer + worker->buffer_length, worker->buffer_size - 1 - worker->buffer_length, MSG_DONTWAIT);
+        signald_trace_end("recv", NULL, start);
+        if (read == 0) {
+            signald_worker_push(worker, NULL, 0, g_strdup("Connection to signald lost."), NULL);
+            break;
+        }
+        if (read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            signald_worker_push(worker, NULL, 0, g_strdup_printf("Reading from signald failed: %s", strerror(errno)), NULL);
+            break;
+        }
+        if (worker->conn->input_record) {
+            // the main thread does not access the file while the worker runs
+            fwrite(worker->buffer + worker->buffer_length, 1, read, worker->conn->input_record);
+        }
+        gsize scan_offset = worker->buffer_length;
+        worker->buffer_length += read;
+        if (!signald_worker_handle_frames(worker, parser, scan_offset)) {
+            break;
+        }
+        if (worker->buffer_size > SIGNALD_INPUT_BUFSIZE_INITIAL && worker->buffer_length < SIGNALD_INPUT_BUFSIZE_INITIAL) {
+            worker->buffer_size = SIGNALD_INPUT_BUFSIZE_INITIAL;
+            worker->buffer = g_realloc(worker->buffer, worker->buffer_size);
+        }
+    }
+    g_object_unref(parser);
+    return NULL;
+}
+
+/*
+ * Main thread side: Handles items from the ring until it is empty or the work budget is exhausted.
+ * Returns TRUE in case the ring is empty.
+ */
+static gboolean
+signald_worker_drain(SignaldWorker *worker)
+{
+    SignaldConnection *conn = worker->conn;
+    while (!signald_input_budget_exhausted(conn)) {
+        gint tail = worker->tail;
+        if (tail == g_atomic_int_get(&worker->head)) {
+            return TRUE;
+        }
+        SignaldWorkerItem item = worker->items[tail % SIGNALD_WORKER_QUEUE_LENGTH];
+        g_atomic_int_set(&worker->tail, tail + 1); // releases the slot
+        if (g_atomic_int_get(&worker->waiting)) {
+            g_mutex_lock(&worker->lock);
+            g_cond_signal(&worker->space);
+            g_mutex_unlock(&worker->lock);
+        }
+        if (item.node != NULL) {
+            if (JSON_NODE_HOLDS_OBJECT(item.node)) {
+                signald_flight_recorder_add(conn, FALSE, json_node_get_object(item.node), item.length);
+            }
+            signald_connection_dispatch(conn, item.node, item.length);
+            json_node_free(item.node);
+            signald_input_budget_spend(conn);
+        } else {
+            if (item.raw != NULL) {
+                signald_flight_recorder_add_raw(conn, item.raw, strlen(item.raw), item.length);
+                g_free(item.raw);
+            }
+            signald_connection_error(conn, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, item.error);
+            g_free(item.error);
+        }
+    }
+    return FALSE;
+}
+
+static gboolean
+signald_worker_drain_cb(gpointer data)
+{
+    SignaldWorker *worker = data;
+    signald_input_budget_reset(worker->conn, TRUE);
+    if (!signald_worker_drain(worker)) {
+        return TRUE; // there is more, come back later
+    }
+    worker->drain_timer = 0;
+    return FALSE;
+}
+
+static void
+signald_worker_notify_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+    SignaldWorker *worker = data;
+    char discard[64];
+    while (read(source, discard, sizeof discard) > 0) {
+        // the notification itself carries no information
+    }
+    g_atomic_int_set(&worker->notified, FALSE); // items published after this will cause a new notification
+    if (worker->drain_timer == 0) {
+        signald_input_budget_reset(worker->conn, TRUE);
+        if (!signald_worker_drain(worker)) {
+            worker->drain_timer = purple_timeout_add(0, signald_worker_drain_cb, worker);
+        }
+    }
+}
+
+static void
+signald_worker_close_pipes(SignaldWorker *worker)
+{
+    for (int i = 0; i < 2; i++) {
+        if (worker->wakeup[i] >= 0) {
+            close(worker->wakeup[i]);
+            worker->wakeup[i] = -1;
+        }
+        if (worker->notify[i] >= 0) {
+            close(worker->notify[i]);
+            worker->notify[i] = -1;
+        }
+    }
+}
+
+/*
+ * Starts reading from fd in the worker thread.
+ * Returns FALSE in case the thread could not be started. The caller should fall back to reading in the main thread.
+ */
+gboolean
+signald_worker_start(SignaldWorker *worker, int fd)
+{
+    g_return_val_if_fail(!worker->running, FALSE);
+    if (pipe(worker->wakeup) != 0 || pipe(worker->notify) != 0) {
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Could not create pipes for worker thread: %s\n", strerror(errno));
+        signald_worker_close_pipes(worker);
+        return FALSE;
+    }
+    fcntl(worker->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(worker->notify[1], F_SETFL, O_NONBLOCK);
+    worker->fd = fd;
+    worker->head = worker->tail = 0;
+    worker->notified = worker->waiting = worker->stop = FALSE;
+    worker->buffer_limit = worker->conn->input_buffer_limit;
+    worker->buffer_size = SIGNALD_INPUT_BUFSIZE_INITIAL;
+    worker->buffer = g_malloc(worker->buffer_size);
+    worker->buffer_length = 0;
+    worker->frame_peak = 0;
+    int err = pthread_create(&worker->thread, NULL, signald_worker_run, worker);
+    if (err != 0) {
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Could not create worker thread: %s\n", strerror(err));
+        signald_worker_close_pipes(worker);
+        g_free(worker->buffer);
+        worker->buffer = NULL;
+        return FALSE;
+    }
+    worker->running = TRUE;
+    worker->notify_watcher = purple_input_add(worker->notify[0], PURPLE_INPUT_READ, signald_worker_notify_cb, worker);
+    purple_debug_info(SIGNALD_PLUGIN_ID, "Reading and parsing in worker thread.\n");
+    return TRUE;
+}
+
+/*
+ * Stops the worker thread. Items which have been parsed already are handled right away.
+ * The unhandled rest of the worker's buffer is moved to the connection's input buffer so reading can continue in the main thread.
+ * Complete frames in it (those the worker could not push while stopping) are handled right away, too.
+ */
+void
+signald_worker_stop(SignaldWorker *worker)
+{
+    if (!worker->running) {
+        return;
+    }
+    SignaldConnection *conn = worker->conn;
+    g_atomic_int_set(&worker->stop, TRUE);
+    char c = 0;
+    if (write(worker->wakeup[1], &c, 1) < 0) {
+        purple_debug_error(SIGNALD_PLUGIN_ID, "Could not wake up worker thread: %s\n", strerror(errno));
+    }
+    g_mutex_lock(&worker->lock);
+    g_cond_signal(&worker->space);
+    g_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+    worker->running = FALSE;
+
+    purple_input_remove(worker->notify_watcher);
+    worker->notify_watcher = 0;
+    if (worker->drain_timer) {
+        purple_timeout_remove(worker->drain_timer);
+        worker->drain_timer = 0;
+    }
+    signald_input_budget_reset(conn, FALSE);
+    signald_worker_drain(worker);
+    signald_worker_close_pipes(worker);
+
+    conn->input_frame_peak = MAX(conn->input_frame_peak, worker->frame_peak);
+    if (!signald_input_buffer_append(conn, worker->buffer, worker->buffer_length)) {
+        purple_debug_warning(SIGNALD_PLUGIN_ID, "Discarded %" G_GSIZE_FORMAT " bytes of incomplete input.\n", worker->buffer_length);
+    }
+    if (memchr(worker->buffer, '\n', worker->buffer_length) != NULL) {
+        signald_input_flush(conn);
+    }
+    g_free(worker->buffer);
+    worker->buffer = NULL;
+    worker->buffer_length = 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "structs.h"
+
+SignaldWorker * signald_worker_new(SignaldConnection *conn);
+
+void signald_worker_free(SignaldWorker *worker);
+
+gboolean signald_worker_start(SignaldWorker *worker, int fd);
+
+void signald_worker_stop(SignaldWorker *worker);